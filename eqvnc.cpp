@@ -17,10 +17,18 @@
  */
 
 #include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
 
 #include <cstdio>
 #include <cstring>
 #include <cmath>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
 
 #include <GL/glew.h>
 #include <eq/eq.h>
@@ -32,57 +40,1268 @@ typedef struct {
     int x, y, w, h;
 } rectangle_t;
 
+typedef struct {
+    int src_x, src_y;   // source position
+    int x, y, w, h;     // destination rectangle
+} copy_rectangle_t;
+
 typedef enum {
     screen_canvas,
     screen_wall,
     screen_cylinder
 } screen_t;
 
-static rfbClient* vnc_client = NULL;
+typedef enum {
+    encoding_raw,       // plain pixels
+    encoding_xor        // pixels XORed with the previous contents
+} encoding_t;
+
+typedef enum {
+    format_rgb32,       // 32 bit pixels as received from the VNC server
+    format_rgb565,      // 16 bit RGB
+    format_yuv420       // 8 bit Y per pixel, 8 bit U and V per 2x2 block
+} transport_format_t;
+
+typedef enum {
+    dirty_changes,      // the transport format, delta encoded if possible
+    dirty_refresh,      // the transport format without delta encoding
+    dirty_video         // YUV 4:2:0 without delta encoding
+} dirty_kind_t;
 
 /* A few little helpers */
 
-static float deg_to_rad(float deg)
-{
-    return static_cast<float>(M_PI) / 180.0f * deg;
-}
+static float deg_to_rad(float deg)
+{
+    return static_cast<float>(M_PI) / 180.0f * deg;
+}
+
+static float rad_to_deg(float rad)
+{
+    return 180.0f / static_cast<float>(M_PI) * rad;
+}
+
+static float dot(const float v[3], const float w[3])
+{
+    return v[0] * w[0] + v[1] * w[1] + v[2] * w[2];
+}
+
+static void cross(const float v[3], const float w[3], float c[3])
+{
+    c[0] = v[1] * w[2] - v[2] * w[1];
+    c[1] = v[2] * w[0] - v[0] * w[2];
+    c[2] = v[0] * w[1] - v[1] * w[0];
+}
+
+static float length(const float v[3])
+{
+    return std::sqrt(dot(v, v));
+}
+
+// 4x4 matrices are stored in column-major order, just like OpenGL does.
+
+static void mat_mult(const float a[16], const float b[16], float r[16])
+{
+    for (int c = 0; c < 4; c++) {
+        for (int l = 0; l < 4; l++) {
+            r[c * 4 + l] = a[0 * 4 + l] * b[c * 4 + 0] + a[1 * 4 + l] * b[c * 4 + 1]
+                + a[2 * 4 + l] * b[c * 4 + 2] + a[3 * 4 + l] * b[c * 4 + 3];
+        }
+    }
+}
+
+static void mat_identity(float m[16])
+{
+    for (int i = 0; i < 16; i++)
+        m[i] = (i % 5 == 0 ? 1.0f : 0.0f);
+}
+
+// Same as glRotatef(), but with the angle in radians
+static void mat_rotation(float angle, const float axis[3], float m[16])
+{
+    mat_identity(m);
+    float l = length(axis);
+    if (l <= 1e-4f)
+        return;
+    float x = axis[0] / l, y = axis[1] / l, z = axis[2] / l;
+    float c = std::cos(angle), s = std::sin(angle);
+    m[0] = x * x * (1.0f - c) + c;
+    m[1] = y * x * (1.0f - c) + z * s;
+    m[2] = x * z * (1.0f - c) - y * s;
+    m[4] = x * y * (1.0f - c) - z * s;
+    m[5] = y * y * (1.0f - c) + c;
+    m[6] = y * z * (1.0f - c) + x * s;
+    m[8] = x * z * (1.0f - c) + y * s;
+    m[9] = y * z * (1.0f - c) - x * s;
+    m[10] = z * z * (1.0f - c) + c;
+}
+
+static void mat_translation(const float t[3], float m[16])
+{
+    mat_identity(m);
+    m[12] = t[0];
+    m[13] = t[1];
+    m[14] = t[2];
+}
+
+static void mat_transform(const float m[16], const float p[3], float r[3])
+{
+    for (int i = 0; i < 3; i++)
+        r[i] = m[0 * 4 + i] * p[0] + m[1 * 4 + i] * p[1] + m[2 * 4 + i] * p[2] + m[3 * 4 + i];
+}
+
+static bool rectangles_overlap(const rectangle_t& a, const rectangle_t& b)
+{
+    return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+static bool overlaps_any(const rectangle_t& r, const std::vector<rectangle_t>& rectangles)
+{
+    for (size_t i = 0; i < rectangles.size(); i++)
+        if (rectangles_overlap(r, rectangles[i]))
+            return true;
+    return false;
+}
+
+static bool clip_rectangle(const rectangle_t& r, const rectangle_t& clip, rectangle_t& result)
+{
+    int x0 = std::max(r.x, clip.x);
+    int y0 = std::max(r.y, clip.y);
+    int x1 = std::min(r.x + r.w, clip.x + clip.w);
+    int y1 = std::min(r.y + r.h, clip.y + clip.h);
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+    result.x = x0;
+    result.y = y0;
+    result.w = x1 - x0;
+    result.h = y1 - y0;
+    return true;
+}
+
+// Add a rectangle to a set of non-overlapping dirty rectangles. The new
+// rectangle is merged with an existing one into their bounding rectangle if
+// they overlap or if the bounding rectangle wastes little area; this repeats
+// until no more merges happen, so the set stays free of overlaps. The set
+// size is limited by merging with the cheapest candidate when it is full.
+static void add_dirty_rectangle(std::vector<rectangle_t>& rectangles, rectangle_t r)
+{
+    const size_t max_rectangles = 128;
+    const long long max_waste_abs = 256;        // pixels
+    const long long max_waste_rel_div = 4;      // 1/4 of the bounding rectangle
+    if (r.w <= 0 || r.h <= 0)
+        return;
+    for (;;) {
+        size_t best = rectangles.size();
+        long long best_waste = 0;
+        for (size_t i = 0; i < rectangles.size(); i++) {
+            const rectangle_t& q = rectangles[i];
+            int x0 = std::min(r.x, q.x);
+            int y0 = std::min(r.y, q.y);
+            int x1 = std::max(r.x + r.w, q.x + q.w);
+            int y1 = std::max(r.y + r.h, q.y + q.h);
+            long long bb_area = static_cast<long long>(x1 - x0) * (y1 - y0);
+            long long union_area = static_cast<long long>(r.w) * r.h + static_cast<long long>(q.w) * q.h;
+            rectangle_t o;
+            if (clip_rectangle(r, q, o))
+                union_area -= static_cast<long long>(o.w) * o.h;
+            long long waste = bb_area - union_area;
+            if (rectangles_overlap(r, q) || waste <= max_waste_abs || waste * max_waste_rel_div <= bb_area) {
+                best = i;
+                break;
+            }
+            if (rectangles.size() >= max_rectangles && (best == rectangles.size() || waste < best_waste)) {
+                best = i;
+                best_waste = waste;
+            }
+        }
+        if (best == rectangles.size())
+            break;
+        const rectangle_t q = rectangles[best];
+        int x0 = std::min(r.x, q.x);
+        int y0 = std::min(r.y, q.y);
+        r.w = std::max(r.x + r.w, q.x + q.w) - x0;
+        r.h = std::max(r.y + r.h, q.y + q.h) - y0;
+        r.x = x0;
+        r.y = y0;
+        rectangles[best] = rectangles.back();
+        rectangles.pop_back();
+    }
+    rectangles.push_back(r);
+}
+
+// Check that a copy operation lies completely inside a framebuffer
+static bool copy_rectangle_valid(const copy_rectangle_t& c, int width, int height)
+{
+    return c.w > 0 && c.h > 0
+        && c.src_x >= 0 && c.src_y >= 0 && c.src_x + c.w <= width && c.src_y + c.h <= height
+        && c.x >= 0 && c.y >= 0 && c.x + c.w <= width && c.y + c.h <= height;
+}
+
+// Copy a rectangle inside a framebuffer; source and destination may overlap
+static void copy_pixels(unsigned int* framebuffer, int width, const copy_rectangle_t& c)
+{
+    if (c.y > c.src_y) {
+        for (int y = c.h - 1; y >= 0; y--)
+            std::memmove(framebuffer + (c.y + y) * width + c.x,
+                    framebuffer + (c.src_y + y) * width + c.src_x, c.w * sizeof(unsigned int));
+    } else {
+        for (int y = 0; y < c.h; y++)
+            std::memmove(framebuffer + (c.y + y) * width + c.x,
+                    framebuffer + (c.src_y + y) * width + c.src_x, c.w * sizeof(unsigned int));
+    }
+}
+
+/* Session traces */
+
+// A trace holds the framebuffer changes of a VNC session so that they can be
+// replayed without a server. The file starts with trace_magic, followed by
+// one record per server message: the time in milliseconds since the start of
+// the recording, the framebuffer size, the number of copies and of
+// rectangles, the copies, and the rectangles each followed by its pixels.
+// All values are 32 bit in host byte order.
+
+static const char trace_magic[8] = { 'E', 'Q', 'V', 'N', 'C', 'T', 'R', '1' };
+
+typedef struct {
+    float time;
+    int width, height;
+    std::vector<copy_rectangle_t> copy_rectangles;
+    std::vector<rectangle_t> dirty_rectangles;
+    std::vector<unsigned int> pixels;   // of all dirty rectangles in order
+} trace_record_t;
+
+static bool write_trace_header(FILE* f)
+{
+    return fwrite(trace_magic, sizeof(trace_magic), 1, f) == 1;
+}
+
+static bool read_trace_header(FILE* f)
+{
+    char magic[sizeof(trace_magic)];
+    return fread(magic, sizeof(magic), 1, f) == 1 && std::memcmp(magic, trace_magic, sizeof(magic)) == 0;
+}
+
+// Write the given changes with the pixels of the dirty rectangles taken from
+// the framebuffer
+static bool write_trace_record(FILE* f, float time, int width, int height,
+        const std::vector<copy_rectangle_t>& copy_rectangles,
+        const std::vector<rectangle_t>& dirty_rectangles, const unsigned int* framebuffer)
+{
+    int32_t header[4] = { width, height,
+        static_cast<int32_t>(copy_rectangles.size()), static_cast<int32_t>(dirty_rectangles.size()) };
+    bool ok = fwrite(&time, sizeof(time), 1, f) == 1 && fwrite(header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < copy_rectangles.size(); i++) {
+        const copy_rectangle_t& c = copy_rectangles[i];
+        int32_t v[6] = { c.src_x, c.src_y, c.x, c.y, c.w, c.h };
+        ok = fwrite(v, sizeof(v), 1, f) == 1;
+    }
+    for (size_t i = 0; ok && i < dirty_rectangles.size(); i++) {
+        const rectangle_t& r = dirty_rectangles[i];
+        int32_t v[4] = { r.x, r.y, r.w, r.h };
+        ok = fwrite(v, sizeof(v), 1, f) == 1;
+        for (int y = r.y; ok && y < r.y + r.h; y++)
+            ok = fwrite(framebuffer + y * width + r.x, r.w * sizeof(unsigned int), 1, f) == 1;
+    }
+    return ok;
+}
+
+// Read the next record. Returns false at the end of the trace or if the
+// record is invalid.
+static bool read_trace_record(FILE* f, trace_record_t& rec)
+{
+    int32_t header[4];
+    if (fread(&rec.time, sizeof(rec.time), 1, f) != 1 || fread(header, sizeof(header), 1, f) != 1)
+        return false;
+    rec.width = header[0];
+    rec.height = header[1];
+    if (rec.width <= 0 || rec.height <= 0 || header[2] < 0 || header[3] < 0)
+        return false;
+    rec.copy_rectangles.resize(header[2]);
+    rec.dirty_rectangles.resize(header[3]);
+    rec.pixels.clear();
+    for (size_t i = 0; i < rec.copy_rectangles.size(); i++) {
+        int32_t v[6];
+        if (fread(v, sizeof(v), 1, f) != 1)
+            return false;
+        copy_rectangle_t c = { v[0], v[1], v[2], v[3], v[4], v[5] };
+        if (!copy_rectangle_valid(c, rec.width, rec.height))
+            return false;
+        rec.copy_rectangles[i] = c;
+    }
+    for (size_t i = 0; i < rec.dirty_rectangles.size(); i++) {
+        int32_t v[4];
+        if (fread(v, sizeof(v), 1, f) != 1)
+            return false;
+        rectangle_t r = { v[0], v[1], v[2], v[3] };
+        rectangle_t fb = { 0, 0, rec.width, rec.height };
+        rectangle_t tmp;
+        if (!clip_rectangle(r, fb, tmp) || tmp.w != r.w || tmp.h != r.h)
+            return false;
+        rec.dirty_rectangles[i] = r;
+        size_t offset = rec.pixels.size();
+        rec.pixels.resize(offset + static_cast<size_t>(r.w) * r.h);
+        if (fread(&(rec.pixels[offset]), r.w * r.h * sizeof(unsigned int), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+// Apply a record to a framebuffer of the record's size
+static void apply_trace_record(const trace_record_t& rec, unsigned int* framebuffer)
+{
+    for (size_t i = 0; i < rec.copy_rectangles.size(); i++)
+        copy_pixels(framebuffer, rec.width, rec.copy_rectangles[i]);
+    size_t offset = 0;
+    for (size_t i = 0; i < rec.dirty_rectangles.size(); i++) {
+        const rectangle_t& r = rec.dirty_rectangles[i];
+        for (int y = r.y; y < r.y + r.h; y++) {
+            std::memcpy(framebuffer + y * rec.width + r.x, &(rec.pixels[offset]), r.w * sizeof(unsigned int));
+            offset += r.w;
+        }
+    }
+}
+
+/* VNC connection */
+
+typedef struct {
+    bool is_key;
+    rfbKeySym key;
+    bool down;
+    int x, y, buttons;
+} input_event_t;
+
+typedef struct {
+    int hot_x, hot_y;
+    int w, h;
+    std::vector<unsigned int> pixels; // 32 bit BGRA, alpha from the cursor mask
+} cursor_t;
+
+// Notification of the main thread about new data from any VNC connection
+class update_notifier
+{
+private:
+    lunchbox::Condition cond;
+    bool signaled;
+
+public:
+    update_notifier() : signaled(false)
+    {
+    }
+
+    void signal()
+    {
+        cond.lock();
+        signaled = true;
+        cond.signal();
+        cond.unlock();
+    }
+
+    // Wait until new data is available or the timeout (in milliseconds)
+    // expires.
+    void wait(uint32_t timeout)
+    {
+        cond.lock();
+        if (!signaled)
+            cond.timedWait(timeout);
+        signaled = false;
+        cond.unlock();
+    }
+};
+
+// The VNC connection runs in its own thread so that decoding does not stall
+// rendering and rendering does not delay reading from the server.
+// libvncclient decodes into decode_framebuffer. After each server message,
+// the changes are applied to ready_framebuffer, from which the main thread
+// picks up the latest complete state once per frame. Since libvncclient is
+// not thread safe, input events are queued and sent by the connection
+// thread. Instead of connecting to a server, the connection can also replay
+// a recorded trace.
+class vnc_connection : public lunchbox::Thread
+{
+private:
+    rfbClient* client;
+    // The arguments for rfbInitClient(), NULL terminated
+    std::vector<char*> client_argv;
+    // A pipe that wakes the connection thread when input events must be
+    // sent at once
+    int wake_pipe[2];
+    FILE* record_file;
+    lunchbox::Clock record_clock;
+    FILE* replay_file;
+    float replay_start_time;    // time of the first record
+    // Connection thread state
+    int decode_width, decode_height;
+    std::vector<unsigned int> decode_framebuffer;
+    bool msg_resized;
+    std::vector<rectangle_t> msg_dirty_rectangles;
+    std::vector<copy_rectangle_t> msg_copy_rectangles;
+    bool skip_update;   // see got_copy_rect()
+    rectangle_t skip_rectangle;
+    bool detect_changes; // see publish()
+    int sent_buttons;   // button state of the last pointer event taken from the queue
+    lunchbox::Clock pointer_clock; // time since the last pointer event sent
+    float pointer_interval;
+    // Adaptive quality, see adapt_quality()
+    bool adaptive_quality;
+    int min_quality;
+    int quality;                // current JPEG quality, or 10 for lossless
+    lunchbox::Clock adapt_clock;
+    float adapt_busy_time;      // ms spent handling messages in this period
+    long long adapt_pixels;     // pixels updated in this period
+    int adapt_calm_periods;
+    // Frame-paced update requests, see pace_update_requests()
+    bool paced_updates;
+    bool request_pending;       // an update request is outstanding
+    bool update_finished;       // the last message completed an update
+    bool update_resized;        // the last message changed the desktop size
+    lunchbox::Clock request_clock; // time since the last update request
+    // Shared state, protected by lock
+    lunchbox::Lock lock;
+    bool quit;
+    bool ready_frame_done;      // a frame was rendered since the last request
+    bool ready_complete;        // the ready framebuffer holds desktop contents
+    bool failed;
+    int ready_width, ready_height;
+    std::vector<unsigned int> ready_framebuffer;
+    bool ready_resized;
+    std::vector<rectangle_t> ready_dirty_rectangles;
+    std::vector<copy_rectangle_t> ready_copy_rectangles;
+    std::vector<input_event_t> input_events;
+    cursor_t ready_cursor;
+    bool ready_cursor_shape_changed;
+    int ready_cursor_x, ready_cursor_y;
+    bool ready_cursor_moved;
+    int ready_messages;         // statistics since the last fetch_stats()
+    float ready_decode_time;
+    // Notification of the main thread about new data
+    update_notifier* notifier;
+
+    static vnc_connection* get(rfbClient* client)
+    {
+        return static_cast<vnc_connection*>(rfbClientGetClientData(client, NULL));
+    }
+
+    static rfbBool resize(rfbClient* client)
+    {
+        //fprintf(stderr, "RESIZE to %dx%d\n", client->width, client->height);
+        vnc_connection* vnc = get(client);
+        vnc->decode_width = client->width;
+        vnc->decode_height = client->height;
+        vnc->decode_framebuffer.resize(client->width * client->height);
+        vnc->msg_resized = true;
+        vnc->msg_dirty_rectangles.clear();
+        vnc->msg_copy_rectangles.clear();
+        vnc->skip_update = false;
+        vnc->update_resized = true;
+        client->updateRect.x = 0;
+        client->updateRect.y = 0;
+        client->updateRect.w = client->width;
+        client->updateRect.h = client->height;
+        client->frameBuffer = reinterpret_cast<uint8_t*>(&(vnc->decode_framebuffer[0]));
+        client->format.bitsPerPixel = 32;
+        client->format.depth = 8;
+        client->format.redMax = 255;
+        client->format.greenMax = 255;
+        client->format.blueMax = 255;
+        client->format.redShift = 16;
+        client->format.greenShift = 8;
+        client->format.blueShift = 0;
+        SetFormatAndEncodings(client);
+        return TRUE;
+    }
+
+    static void update(rfbClient* client, int x, int y, int w, int h)
+    {
+        //fprintf(stderr, "UPDATING %dx%d rectangle at %d,%d\n", w, h, x, y);
+        vnc_connection* vnc = get(client);
+        vnc->update_finished = true;
+        if (vnc->skip_update) {
+            vnc->skip_update = false;
+            if (x == vnc->skip_rectangle.x && y == vnc->skip_rectangle.y
+                    && w == vnc->skip_rectangle.w && h == vnc->skip_rectangle.h)
+                return;
+        }
+        rectangle_t r = { x, y, w, h };
+        rectangle_t fb = { 0, 0, client->width, client->height };
+        if (clip_rectangle(r, fb, r)) {
+            add_dirty_rectangle(vnc->msg_dirty_rectangles, r);
+            vnc->adapt_pixels += static_cast<long long>(r.w) * r.h;
+        }
+    }
+
+#ifdef HAVE_RFBCLIENT_FINISHEDFRAMEBUFFERUPDATE
+    static void finished_update(rfbClient* client)
+    {
+        get(client)->update_finished = true;
+    }
+#endif
+
+#ifdef HAVE_RFBCLIENT_GOTCOPYRECT
+    static void got_copy_rect(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y)
+    {
+        //fprintf(stderr, "COPYING %dx%d rectangle from %d,%d to %d,%d\n", w, h, src_x, src_y, dest_x, dest_y);
+        vnc_connection* vnc = get(client);
+        copy_rectangle_t c = { src_x, src_y, dest_x, dest_y, w, h };
+        if (!copy_rectangle_valid(c, client->width, client->height))
+            return;
+        copy_pixels(&(vnc->decode_framebuffer[0]), client->width, c);
+        // If the source was modified earlier in this frame, the render nodes
+        // do not have it yet; send the destination pixels in that case.
+        rectangle_t src = { src_x, src_y, w, h };
+        bool src_modified = overlaps_any(src, vnc->msg_dirty_rectangles);
+        if (!src_modified) {
+            lunchbox::ScopedMutex<> mutex(vnc->lock);
+            src_modified = overlaps_any(src, vnc->ready_dirty_rectangles);
+        }
+        if (!src_modified) {
+            vnc->msg_copy_rectangles.push_back(c);
+            // libvncclient reports the destination rectangle via
+            // GotFrameBufferUpdate afterwards, but its pixels do not need to
+            // be sent.
+            vnc->skip_update = true;
+            vnc->skip_rectangle.x = dest_x;
+            vnc->skip_rectangle.y = dest_y;
+            vnc->skip_rectangle.w = w;
+            vnc->skip_rectangle.h = h;
+        }
+    }
+#endif
+
+    // With useRemoteCursor, the server sends the cursor shape separately
+    // instead of painting it into the framebuffer.
+    static void got_cursor_shape(rfbClient* client, int xhot, int yhot, int width, int height, int bytes_per_pixel)
+    {
+        vnc_connection* vnc = get(client);
+        if (bytes_per_pixel != 4 || !client->rcSource || !client->rcMask)
+            return;
+        lunchbox::ScopedMutex<> mutex(vnc->lock);
+        cursor_t& cursor = vnc->ready_cursor;
+        cursor.hot_x = xhot;
+        cursor.hot_y = yhot;
+        cursor.w = width;
+        cursor.h = height;
+        cursor.pixels.resize(width * height);
+        const unsigned int* source = reinterpret_cast<const unsigned int*>(client->rcSource);
+        for (int i = 0; i < width * height; i++)
+            cursor.pixels[i] = (source[i] & 0x00ffffffu) | (client->rcMask[i] ? 0xff000000u : 0u);
+        vnc->ready_cursor_shape_changed = true;
+    }
+
+    static rfbBool handle_cursor_pos(rfbClient* client, int x, int y)
+    {
+        vnc_connection* vnc = get(client);
+        lunchbox::ScopedMutex<> mutex(vnc->lock);
+        vnc->ready_cursor_x = x;
+        vnc->ready_cursor_y = y;
+        vnc->ready_cursor_moved = true;
+        return TRUE;
+    }
+
+    bool rectangle_changed(const rectangle_t& r) const
+    {
+        for (int y = r.y; y < r.y + r.h; y++) {
+            if (std::memcmp(&(ready_framebuffer[y * ready_width + r.x]),
+                        &(decode_framebuffer[y * ready_width + r.x]), r.w * sizeof(unsigned int)) != 0)
+                return true;
+        }
+        return false;
+    }
+
+    void publish_rectangle(const rectangle_t& r)
+    {
+        for (int y = r.y; y < r.y + r.h; y++)
+            std::memcpy(&(ready_framebuffer[y * ready_width + r.x]),
+                    &(decode_framebuffer[y * ready_width + r.x]), r.w * sizeof(unsigned int));
+        add_dirty_rectangle(ready_dirty_rectangles, r);
+    }
+
+    // Apply the changes of the last server message to the ready state
+    void publish()
+    {
+        if (record_file) {
+            std::vector<rectangle_t> full(1);
+            full[0].x = full[0].y = 0;
+            full[0].w = decode_width;
+            full[0].h = decode_height;
+            if (!write_trace_record(record_file, record_clock.getTimef(), decode_width, decode_height,
+                        msg_resized ? std::vector<copy_rectangle_t>() : msg_copy_rectangles,
+                        msg_resized ? full : msg_dirty_rectangles, &(decode_framebuffer[0]))) {
+                fprintf(stderr, "Cannot write trace; recording stopped\n");
+                fclose(record_file);
+                record_file = NULL;
+            }
+        }
+        lunchbox::ScopedMutex<> mutex(lock);
+        bool published = (msg_resized || !msg_copy_rectangles.empty());
+        if (msg_resized) {
+            ready_width = decode_width;
+            ready_height = decode_height;
+            ready_framebuffer = decode_framebuffer;
+            ready_resized = true;
+            ready_dirty_rectangles.clear();
+            ready_copy_rectangles.clear();
+            rectangle_t r = { 0, 0, ready_width, ready_height };
+            ready_dirty_rectangles.push_back(r);
+        } else {
+            for (size_t i = 0; i < msg_copy_rectangles.size(); i++) {
+                copy_pixels(&(ready_framebuffer[0]), ready_width, msg_copy_rectangles[i]);
+                ready_copy_rectangles.push_back(msg_copy_rectangles[i]);
+            }
+            for (size_t i = 0; i < msg_dirty_rectangles.size(); i++) {
+                const rectangle_t& r = msg_dirty_rectangles[i];
+                if (!detect_changes) {
+                    publish_rectangle(r);
+                    published = true;
+                    continue;
+                }
+                // Some servers send large updates in which most pixels did
+                // not change. Compare the update tile by tile with the
+                // previous contents and only publish the tiles that changed.
+                // The comparisons run in parallel if OpenMP is available.
+                const int T = 32;
+                std::vector<rectangle_t> tiles;
+                for (int y0 = r.y; y0 < r.y + r.h; y0 = (y0 / T + 1) * T) {
+                    int y1 = std::min((y0 / T + 1) * T, r.y + r.h);
+                    for (int x0 = r.x; x0 < r.x + r.w; x0 = (x0 / T + 1) * T) {
+                        int x1 = std::min((x0 / T + 1) * T, r.x + r.w);
+                        rectangle_t t = { x0, y0, x1 - x0, y1 - y0 };
+                        tiles.push_back(t);
+                    }
+                }
+                const int n = tiles.size();
+                std::vector<char> changed(n);
+                #pragma omp parallel for schedule(dynamic, 16)
+                for (int k = 0; k < n; k++)
+                    changed[k] = rectangle_changed(tiles[k]);
+                for (int k = 0; k < n; k++) {
+                    if (changed[k]) {
+                        publish_rectangle(tiles[k]);
+                        published = true;
+                    }
+                }
+            }
+        }
+        // An update without visible changes does not cause a frame (e.g. in
+        // on-demand mode), so it must not hold back the next update request
+        if (update_finished && !published)
+            ready_frame_done = true;
+        // After connecting, only the desktop size is known until the first
+        // update arrived; a replayed trace starts with the complete desktop
+        if (update_finished || replay_file)
+            ready_complete = true;
+        msg_resized = false;
+        msg_dirty_rectangles.clear();
+        msg_copy_rectangles.clear();
+        notifier->signal();
+    }
+
+    // Send the queued input events with a single write. Consecutive pointer
+    // motions are already merged in the queue; a queue that only holds a
+    // motion is kept until pointer_interval has passed since the last
+    // pointer event, so that fast mouse movement does not flood the server.
+    // Key and button events are sent immediately and in order.
+    void send_input()
+    {
+        std::vector<input_event_t> events;
+        {
+            lunchbox::ScopedMutex<> mutex(lock);
+            if (!client) {
+                // Replaying a trace; there is no server
+                input_events.clear();
+                return;
+            }
+            if (input_events.size() == 1 && !input_events[0].is_key
+                    && input_events[0].buttons == sent_buttons
+                    && pointer_clock.getTimef() < pointer_interval)
+                return;
+            for (size_t i = 0; i < input_events.size(); i++) {
+                if (!input_events[i].is_key)
+                    sent_buttons = input_events[i].buttons;
+            }
+            events.swap(input_events);
+        }
+        if (events.empty())
+            return;
+        std::vector<char> buf;
+        for (size_t i = 0; i < events.size(); i++) {
+            const input_event_t& e = events[i];
+            if (e.is_key) {
+                rfbKeyEventMsg ke;
+                std::memset(&ke, 0, sizeof(ke));
+                ke.type = rfbKeyEvent;
+                ke.down = e.down ? 1 : 0;
+                ke.key = rfbClientSwap32IfLE(e.key);
+                buf.insert(buf.end(), reinterpret_cast<char*>(&ke), reinterpret_cast<char*>(&ke) + sz_rfbKeyEventMsg);
+            } else {
+                rfbPointerEventMsg pe;
+                pe.type = rfbPointerEvent;
+                pe.buttonMask = e.buttons;
+                pe.x = rfbClientSwap16IfLE(static_cast<uint16_t>(std::max(e.x, 0)));
+                pe.y = rfbClientSwap16IfLE(static_cast<uint16_t>(std::max(e.y, 0)));
+                buf.insert(buf.end(), reinterpret_cast<char*>(&pe), reinterpret_cast<char*>(&pe) + sz_rfbPointerEventMsg);
+                pointer_clock.reset();
+            }
+        }
+        WriteToRFBServer(client, &(buf[0]), buf.size());
+    }
+
+    // With paced_updates, libvncclient must not request updates on its own
+    // after each update. Hide the request message from the messages that it
+    // believes the server supports; the server may announce them again with
+    // any update.
+    void block_update_requests()
+    {
+        const int m = rfbFramebufferUpdateRequest;
+        client->supportedMessages.client2server[m / 8] &= ~(1 << (m % 8));
+    }
+
+    void send_update_request(int x, int y, int w, int h, bool incremental)
+    {
+        const int m = rfbFramebufferUpdateRequest;
+        client->supportedMessages.client2server[m / 8] |= (1 << (m % 8));
+        SendFramebufferUpdateRequest(client, x, y, w, h, incremental ? TRUE : FALSE);
+        if (paced_updates)
+            block_update_requests();
+        request_pending = true;
+        request_clock.reset();
+    }
+
+    // Keep at most one update request outstanding, and only send the next
+    // one after the main thread rendered a frame with the previous update.
+    // The server then never sends more updates than we can draw, and each
+    // update it sends covers all changes up to that point. A request that
+    // got no complete update within a second is sent again, in case an
+    // update went unnoticed.
+    void pace_update_requests()
+    {
+        if (update_resized) {
+            // libvncclient's own request for the new framebuffer was blocked
+            send_update_request(0, 0, client->width, client->height, false);
+            update_resized = false;
+            update_finished = false;
+            return;
+        }
+        if (request_pending && !update_finished && request_clock.getTimef() > 1000.0f) {
+            // The request got no update to draw; resend it without waiting
+            // for a frame
+            lunchbox::ScopedMutex<> mutex(lock);
+            ready_frame_done = true;
+        }
+        if (update_finished || request_clock.getTimef() > 1000.0f) {
+            request_pending = false;
+            update_finished = false;
+        }
+        if (request_pending)
+            return;
+        {
+            lunchbox::ScopedMutex<> mutex(lock);
+            if (!ready_frame_done)
+                return;
+            ready_frame_done = false;
+        }
+        send_update_request(0, 0, client->width, client->height, true);
+    }
+
+    void set_quality(int q)
+    {
+        quality = q;
+        client->appData.enableJPEG = (q <= 9) ? TRUE : FALSE;
+        if (q <= 9)
+            client->appData.qualityLevel = q;
+        SetFormatAndEncodings(client);
+        if (paced_updates)
+            block_update_requests();
+        // Replace the lossy parts of the desktop
+        if (q > 9)
+            send_update_request(0, 0, client->width, client->height, false);
+    }
+
+    // Once per second, lower the JPEG quality if the connection thread was
+    // busy receiving and decoding most of the time (the link or the decoder
+    // is saturated) or if large parts of the desktop changed (heavy
+    // motion), and raise it again in steps after two calm periods, up to
+    // lossless. This only affects servers that use the Tight encoding.
+    void adapt_quality()
+    {
+        float period = adapt_clock.getTimef();
+        if (!adaptive_quality || period < 1000.0f)
+            return;
+        float busy = adapt_busy_time / period;
+        float desktop_pixels = std::max(static_cast<float>(decode_width) * decode_height, 1.0f);
+        float desktops_per_second = adapt_pixels / desktop_pixels / (period / 1000.0f);
+        int q = quality;
+        if (busy > 0.5f || desktops_per_second > 2.0f) {
+            q = std::max(std::min(quality - 2, 9), min_quality);
+            adapt_calm_periods = 0;
+        } else if (busy < 0.1f && desktops_per_second < 0.25f) {
+            if (++adapt_calm_periods >= 2) {
+                q = std::min(quality + 2, 10);
+                adapt_calm_periods = 0;
+            }
+        } else {
+            adapt_calm_periods = 0;
+        }
+        adapt_clock.reset();
+        adapt_busy_time = 0.0f;
+        adapt_pixels = 0;
+        if (q != quality)
+            set_quality(q);
+    }
+
+    bool quit_requested()
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        return quit;
+    }
+
+    // Use a trace record as the next server message
+    void replay_record(const trace_record_t& rec)
+    {
+        if (rec.width != decode_width || rec.height != decode_height) {
+            decode_width = rec.width;
+            decode_height = rec.height;
+            decode_framebuffer.resize(decode_width * decode_height);
+            msg_resized = true;
+        }
+        apply_trace_record(rec, &(decode_framebuffer[0]));
+        msg_copy_rectangles.insert(msg_copy_rectangles.end(),
+                rec.copy_rectangles.begin(), rec.copy_rectangles.end());
+        for (size_t i = 0; i < rec.dirty_rectangles.size(); i++)
+            add_dirty_rectangle(msg_dirty_rectangles, rec.dirty_rectangles[i]);
+        publish();
+    }
+
+    // Replay the trace in real time after its first record
+    void run_replay()
+    {
+        lunchbox::Clock replay_clock;
+        trace_record_t rec;
+        bool have_record = read_trace_record(replay_file, rec);
+        while (!quit_requested()) {
+            if (!have_record) {
+                // End of the trace: keep showing its last state
+                lunchbox::sleep(10);
+                continue;
+            }
+            float wait = rec.time - replay_start_time - replay_clock.getTimef();
+            if (wait > 0.0f) {
+                lunchbox::sleep(std::min(static_cast<uint32_t>(wait) + 1, 10u));
+                continue;
+            }
+            replay_record(rec);
+            have_record = read_trace_record(replay_file, rec);
+        }
+    }
+
+public:
+    vnc_connection(update_notifier* n) : client(NULL), record_file(NULL), replay_file(NULL), replay_start_time(0.0f),
+        decode_width(0), decode_height(0), msg_resized(false), skip_update(false),
+        detect_changes(false), sent_buttons(0), pointer_interval(0.0f),
+        adaptive_quality(false), min_quality(0), quality(10),
+        adapt_busy_time(0.0f), adapt_pixels(0), adapt_calm_periods(0),
+        paced_updates(false), request_pending(false), update_finished(false), update_resized(false),
+        quit(false), ready_frame_done(false), ready_complete(false), failed(false), ready_width(0), ready_height(0), ready_resized(false),
+        ready_cursor_shape_changed(false), ready_cursor_x(0), ready_cursor_y(0), ready_cursor_moved(false),
+        ready_messages(0), ready_decode_time(0.0f), notifier(n)
+    {
+        ready_cursor.hot_x = ready_cursor.hot_y = ready_cursor.w = ready_cursor.h = 0;
+        wake_pipe[0] = wake_pipe[1] = -1;
+    }
+
+    virtual ~vnc_connection()
+    {
+        if (client)
+            rfbClientCleanup(client);
+        if (wake_pipe[0] >= 0) {
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+        }
+        if (record_file)
+            fclose(record_file);
+        if (replay_file)
+            fclose(replay_file);
+    }
+
+    // Record all changes to a trace file. Call this before connecting.
+    bool set_record_file(const char* file_name)
+    {
+        record_file = fopen(file_name, "wb");
+        if (!record_file || !write_trace_header(record_file)) {
+            fprintf(stderr, "Cannot write %s: %s\n", file_name, std::strerror(errno));
+            return false;
+        }
+        record_clock.reset();
+        return true;
+    }
+
+    // Only forward the parts of server updates that really changed. Call
+    // this before starting the connection thread.
+    void set_change_detection(bool enable)
+    {
+        detect_changes = enable;
+    }
+
+    // Set the minimum time in milliseconds between two pointer motion
+    // messages. Call this before starting the connection thread.
+    void set_pointer_interval(float ms)
+    {
+        pointer_interval = ms;
+    }
+
+    // Adapt the JPEG quality to the load, between lossless and min_quality
+    // (0-9). The connection starts lossless. Call this before connecting.
+    void set_adaptive_quality(int min_q)
+    {
+        adaptive_quality = true;
+        min_quality = min_q;
+    }
+
+    // Only request a new update from the server after the previous one was
+    // rendered. Call this before connecting.
+    void set_paced_updates(bool enable)
+    {
+        paced_updates = enable;
+    }
+
+    // Prepare the connection to the server given in the libvncclient
+    // arguments. The connection thread connects when it starts, so that
+    // connecting and receiving the first update overlap with the
+    // initialization of the Equalizer configuration. With local_cursor, the
+    // server is asked to send the cursor shape instead of drawing the cursor
+    // into the framebuffer.
+    void init_client(int argc, char* argv[], bool local_cursor)
+    {
+        client_argv.assign(argv, argv + argc);
+        client_argv.push_back(NULL);
+        if (pipe(wake_pipe) == 0) {
+            fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+        } else {
+            wake_pipe[0] = wake_pipe[1] = -1;
+        }
+        client = rfbGetClient(8, 3, 4); // 32 bpp
+        rfbClientSetClientData(client, NULL, this);
+        client->MallocFrameBuffer = resize;
+        client->canHandleNewFBSize = TRUE;
+        client->GotFrameBufferUpdate = update;
+#ifdef HAVE_RFBCLIENT_GOTCOPYRECT
+        client->GotCopyRect = got_copy_rect;
+#endif
+        if (local_cursor) {
+            client->appData.useRemoteCursor = TRUE;
+            client->GotCursorShape = got_cursor_shape;
+            client->HandleCursorPos = handle_cursor_pos;
+        }
+        if (adaptive_quality)
+            client->appData.enableJPEG = FALSE;
+        client->listenPort = LISTEN_PORT_OFFSET;
+#ifdef HAVE_RFBCLIENT_LISTEN6PORT
+        client->listen6Port = LISTEN_PORT_OFFSET;
+#endif
+#ifdef HAVE_RFBCLIENT_FINISHEDFRAMEBUFFERUPDATE
+        client->FinishedFrameBufferUpdate = finished_update;
+#endif
+    }
+
+    // Called by the connection thread
+    bool connect()
+    {
+        int argc = client_argv.size() - 1;
+        if (!rfbInitClient(client, &argc, &(client_argv[0]))) {
+            // rfbInitClient() frees the client on failure
+            client = NULL;
+            return false;
+        }
+        if (paced_updates) {
+            // rfbInitClient() requested the first update
+            block_update_requests();
+            request_pending = true;
+            request_clock.reset();
+            update_resized = false;
+        }
+        publish();
+        return true;
+    }
+
+    // Replay the given trace instead of connecting to a server; the first
+    // record is applied at once.
+    bool init_replay(const char* file_name)
+    {
+        replay_file = fopen(file_name, "rb");
+        if (!replay_file) {
+            fprintf(stderr, "Cannot open %s: %s\n", file_name, std::strerror(errno));
+            return false;
+        }
+        trace_record_t rec;
+        if (!read_trace_header(replay_file) || !read_trace_record(replay_file, rec)) {
+            fprintf(stderr, "%s is not a valid trace\n", file_name);
+            return false;
+        }
+        replay_start_time = rec.time;
+        replay_record(rec);
+        return true;
+    }
+
+    virtual void run()
+    {
+        if (replay_file) {
+            run_replay();
+            return;
+        }
+        if (!connect()) {
+            fprintf(stderr, "Cannot initialize VNC client\n");
+            {
+                lunchbox::ScopedMutex<> mutex(lock);
+                failed = true;
+            }
+            notifier->signal();
+            return;
+        }
+        lunchbox::Clock decode_clock;
+        while (!quit_requested()) {
+            int i = wait_for_message(5000);
+            decode_clock.reset();
+            if (i < 0 || (i > 0 && !HandleRFBServerMessage(client))) {
+                lunchbox::ScopedMutex<> mutex(lock);
+                failed = true;
+                break;
+            }
+            if (i > 0) {
+                float decode_time = decode_clock.getTimef();
+                adapt_busy_time += decode_time;
+                publish();
+                lunchbox::ScopedMutex<> mutex(lock);
+                ready_messages++;
+                ready_decode_time += decode_time;
+            }
+            if (i > 0 && paced_updates)
+                block_update_requests();
+            send_input();
+            adapt_quality();
+            if (paced_updates)
+                pace_update_requests();
+        }
+    }
+
+    // Like WaitForMessage(), but also return early when wake() is called.
+    // Returns 1 if the server sent data, 0 otherwise, and -1 on errors.
+    int wait_for_message(unsigned int usecs)
+    {
+        if (wake_pipe[0] < 0)
+            return WaitForMessage(client, usecs);
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(client->sock, &fds);
+        FD_SET(wake_pipe[0], &fds);
+        struct timeval timeout;
+        timeout.tv_sec = usecs / 1000000;
+        timeout.tv_usec = usecs % 1000000;
+        int n = select(std::max(client->sock, wake_pipe[0]) + 1, &fds, NULL, NULL, &timeout);
+        if (n < 0)
+            return (errno == EINTR ? 0 : -1);
+        if (FD_ISSET(wake_pipe[0], &fds)) {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+        return FD_ISSET(client->sock, &fds) ? 1 : 0;
+    }
+
+    // Wake the connection thread from wait_for_message()
+    void wake()
+    {
+        if (wake_pipe[1] >= 0) {
+            char c = 0;
+            if (write(wake_pipe[1], &c, 1) < 0) {
+                // The pipe is full, so the thread wakes anyway
+            }
+        }
+    }
+
+    void stop()
+    {
+        {
+            lunchbox::ScopedMutex<> mutex(lock);
+            quit = true;
+        }
+        wake();
+        join();
+    }
+
+    bool has_failed()
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        return failed;
+    }
+
+    // Whether the first framebuffer update after connecting was received
+    bool has_desktop()
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        return ready_complete;
+    }
+
+    // Called by the main thread after it rendered a frame
+    void frame_done()
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        ready_frame_done = true;
+    }
+
+    // Called by the main thread: get all changes since the last call. The
+    // changes are added to those that the caller has not sent yet.
+    void fetch(int& width, int& height, std::vector<unsigned int>& framebuffer,
+            std::vector<rectangle_t>& dirty_rectangles,
+            std::vector<copy_rectangle_t>& copy_rectangles)
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        if (ready_resized) {
+            width = ready_width;
+            height = ready_height;
+            framebuffer = ready_framebuffer;
+            ready_resized = false;
+            // Pending changes refer to the old size; the full rectangle
+            // replaces them
+            dirty_rectangles.clear();
+            copy_rectangles.clear();
+        } else {
+            for (size_t i = 0; i < ready_copy_rectangles.size(); i++)
+                copy_pixels(&(framebuffer[0]), width, ready_copy_rectangles[i]);
+            for (size_t i = 0; i < ready_dirty_rectangles.size(); i++) {
+                const rectangle_t& r = ready_dirty_rectangles[i];
+                for (int y = r.y; y < r.y + r.h; y++)
+                    std::memcpy(&(framebuffer[y * width + r.x]),
+                            &(ready_framebuffer[y * width + r.x]), r.w * sizeof(unsigned int));
+            }
+        }
+        // The render nodes apply copies before dirty rectangles, so a copy
+        // whose source is still pending as a dirty rectangle (e.g. because
+        // --max-fps delayed the frame) is sent as dirty rectangle instead.
+        for (size_t i = 0; i < ready_copy_rectangles.size(); i++) {
+            const copy_rectangle_t& c = ready_copy_rectangles[i];
+            rectangle_t src = { c.src_x, c.src_y, c.w, c.h };
+            if (overlaps_any(src, dirty_rectangles)) {
+                rectangle_t dst = { c.x, c.y, c.w, c.h };
+                add_dirty_rectangle(dirty_rectangles, dst);
+            } else {
+                copy_rectangles.push_back(c);
+            }
+        }
+        for (size_t i = 0; i < ready_dirty_rectangles.size(); i++)
+            add_dirty_rectangle(dirty_rectangles, ready_dirty_rectangles[i]);
+        ready_dirty_rectangles.clear();
+        ready_copy_rectangles.clear();
+    }
+
+    // Called by the main thread: get the cursor shape if it changed, and the
+    // pointer position. Returns whether anything changed since the last call.
+    bool fetch_cursor(cursor_t& cursor, bool& shape_changed, int& x, int& y)
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        bool changed = ready_cursor_shape_changed || ready_cursor_moved;
+        shape_changed = ready_cursor_shape_changed;
+        if (ready_cursor_shape_changed)
+            cursor = ready_cursor;
+        x = ready_cursor_x;
+        y = ready_cursor_y;
+        ready_cursor_shape_changed = false;
+        ready_cursor_moved = false;
+        return changed;
+    }
 
-static float rad_to_deg(float rad)
-{
-    return 180.0f / static_cast<float>(M_PI) * rad;
-}
+    // Called by the main thread: get the number of server messages handled
+    // and the time in milliseconds spent decoding them since the last call.
+    void fetch_stats(int& messages, float& decode_time)
+    {
+        lunchbox::ScopedMutex<> mutex(lock);
+        messages = ready_messages;
+        decode_time = ready_decode_time;
+        ready_messages = 0;
+        ready_decode_time = 0.0f;
+    }
 
-static float dot(const float v[3], const float w[3])
-{
-    return v[0] * w[0] + v[1] * w[1] + v[2] * w[2];
-}
+    void send_key(rfbKeySym key, bool down)
+    {
+        input_event_t e = { true, key, down, 0, 0, 0 };
+        {
+            lunchbox::ScopedMutex<> mutex(lock);
+            input_events.push_back(e);
+        }
+        wake();
+    }
 
-static void cross(const float v[3], const float w[3], float c[3])
-{
-    c[0] = v[1] * w[2] - v[2] * w[1];
-    c[1] = v[2] * w[0] - v[0] * w[2];
-    c[2] = v[0] * w[1] - v[1] * w[0];
-}
+    void send_pointer(int x, int y, int buttons)
+    {
+        input_event_t e = { false, 0, false, x, y, buttons };
+        bool transition;
+        {
+            lunchbox::ScopedMutex<> mutex(lock);
+            // Merge consecutive pointer motions: only the latest position
+            // matters. The queued event is only replaced if it is a pure
+            // motion, i.e. it does not change the button state; button
+            // transitions and wheel events are kept so that their positions
+            // and counts survive.
+            const int wheel_mask = rfbWheelUpMask | rfbWheelDownMask;
+            int previous_buttons = sent_buttons;
+            int last_buttons = sent_buttons;
+            for (size_t i = 0; i < input_events.size(); i++) {
+                if (!input_events[i].is_key) {
+                    if (i + 1 < input_events.size())
+                        previous_buttons = input_events[i].buttons;
+                    last_buttons = input_events[i].buttons;
+                }
+            }
+            transition = (buttons != last_buttons || (buttons & wheel_mask));
+            if (!input_events.empty() && !input_events.back().is_key
+                    && input_events.back().buttons == previous_buttons
+                    && input_events.back().buttons == buttons
+                    && !(buttons & wheel_mask))
+                input_events.back() = e;
+            else
+                input_events.push_back(e);
+            // Show the local pointer position without waiting for the server
+            if (x != ready_cursor_x || y != ready_cursor_y) {
+                ready_cursor_x = x;
+                ready_cursor_y = y;
+                ready_cursor_moved = true;
+            }
+        }
+        // Pure motions wait for the pointer interval; button and wheel
+        // transitions go out at once
+        if (transition)
+            wake();
+    }
+};
 
-static float length(const float v[3])
-{
-    return std::sqrt(dot(v, v));
-}
+// The connections to the VNC servers, one per desktop
+static std::vector<vnc_connection*> vnc_connections;
 
 /* Equalizer code */
 
 class eq_init_data : public co::Object
 {
 public:
-    eq::uint128_t frame_data_id;
+    // One frame data object per desktop
+    std::vector<eq::uint128_t> frame_data_ids;
     bool view_only;
     screen_t screen;
     float wall[9];      // bottom left, bottom right, top left
     float cylinder[10]; // cylinder center, cylinder up vector, radius,
                         // azimuth center, azimuth range, polar range
     float head_matrix[16];
+    // Whether the render nodes report statistics, and whether they draw the
+    // statistics overlay
+    bool stats;
+    bool stats_hud;
+    // Whether the render nodes reduce the texture resolution of desktops
+    // that their channels show at a low pixel density
+    bool lod;
+    // In --roi mode: the frame data object that each render node should map
+    // instead of the one given in frame_data_ids (there is only one desktop
+    // then)
+    std::vector<eq::uint128_t> roi_node_ids;
+    std::vector<eq::uint128_t> roi_frame_data_ids;
 
-    eq_init_data()
+    eq_init_data() : stats(false), stats_hud(false), lod(false)
     {
     }
 
@@ -94,7 +1313,10 @@ protected:
 
     virtual void getInstanceData(co::DataOStream& os)
     {
-        os << frame_data_id;
+        size_t d = frame_data_ids.size();
+        os << d;
+        for (size_t i = 0; i < d; i++)
+            os << frame_data_ids[i];
         os << view_only;
         os << static_cast<int>(screen);
 #if EQ_VERSION_GE(1,6,0)
@@ -106,12 +1328,21 @@ protected:
         os.write(cylinder, 10 * sizeof(float));
         os.write(head_matrix, 16 * sizeof(float));
 #endif
+        os << stats << stats_hud << lod;
+        size_t n = roi_node_ids.size();
+        os << n;
+        for (size_t i = 0; i < n; i++)
+            os << roi_node_ids[i] << roi_frame_data_ids[i];
     }
 
     virtual void applyInstanceData(co::DataIStream& is)
     {
         int x;
-        is >> frame_data_id;
+        size_t d;
+        is >> d;
+        frame_data_ids.resize(d);
+        for (size_t i = 0; i < d; i++)
+            is >> frame_data_ids[i];
         is >> view_only;
         is >> x; screen = static_cast<screen_t>(x);
 #if EQ_VERSION_GE(1,6,0)
@@ -123,20 +1354,842 @@ protected:
         is.read(cylinder, 10 * sizeof(float));
         is.read(head_matrix, 16 * sizeof(float));
 #endif
+        is >> stats >> stats_hud >> lod;
+        size_t n;
+        is >> n;
+        roi_node_ids.resize(n);
+        roi_frame_data_ids.resize(n);
+        for (size_t i = 0; i < n; i++)
+            is >> roi_node_ids[i] >> roi_frame_data_ids[i];
+    }
+};
+
+/* Screen geometry */
+
+// The transformation that eq_channel applies to draw the cylinder
+static void cylinder_matrix(const float cylinder[10], float m[16])
+{
+    const float center[3] = { cylinder[0], cylinder[1], cylinder[2] };
+    const float up[3] = { cylinder[3], cylinder[4], cylinder[5] };
+    const float default_up[3] = { 0.0f, 1.0f, 0.0f };
+    float rot_axis[3];
+    cross(default_up, up, rot_axis);
+    float rot_angle = std::acos(dot(default_up, up) / std::sqrt(dot(default_up, default_up) * dot(up, up)));
+    float r90[16], rup[16], t[16], tmp[16];
+    mat_rotation(static_cast<float>(M_PI) / 2.0f, default_up, r90);
+    mat_rotation(rot_angle, rot_axis, rup);
+    mat_translation(center, t);
+    mat_mult(r90, rup, tmp);
+    mat_mult(tmp, t, m);
+}
+
+// Get the world coordinates of the point with the relative desktop
+// coordinates u,v (origin top left) on a wall or cylinder screen.
+static void screen_point(const eq_init_data& init_data, float u, float v, float p[3])
+{
+    if (init_data.screen == screen_wall) {
+        const float* bl = init_data.wall + 0;
+        const float* br = init_data.wall + 3;
+        const float* tl = init_data.wall + 6;
+        for (int i = 0; i < 3; i++)
+            p[i] = bl[i] + u * (br[i] - bl[i]) + (1.0f - v) * (tl[i] - bl[i]);
+    } else {
+        float radius = init_data.cylinder[6];
+        float phi_center = init_data.cylinder[7];
+        float phi_range = init_data.cylinder[8];
+        float theta_range = init_data.cylinder[9];
+        float py = radius * std::tan(theta_range / 2.0f);
+        float phi = phi_center + (u - 0.5f) * phi_range;
+        float q[3] = { radius * std::cos(phi), py * (1.0f - 2.0f * v), radius * std::sin(phi) };
+        float m[16];
+        cylinder_matrix(init_data.cylinder, m);
+        mat_transform(m, q, p);
+    }
+}
+
+// Project the world point p as seen from the eye onto the plane of the given
+// wall (bottom left, bottom right, top left) and return the relative wall
+// coordinates s,t (origin bottom left).
+static bool project_to_wall(const float eye[3], const float p[3], const float wall[9], float& s, float& t)
+{
+    float d[3], a[3], b[3], n[3], e[3];
+    for (int i = 0; i < 3; i++) {
+        d[i] = p[i] - eye[i];
+        a[i] = wall[3 + i] - wall[i];
+        b[i] = wall[6 + i] - wall[i];
+        e[i] = wall[i] - eye[i];
+    }
+    cross(a, b, n);
+    float denom = dot(d, n);
+    if (std::fabs(denom) < 1e-8f)
+        return false;
+    float lambda = dot(e, n) / denom;
+    if (lambda <= 0.0f)
+        return false;
+    float h[3];
+    for (int i = 0; i < 3; i++)
+        h[i] = eye[i] + lambda * d[i] - wall[i];
+    float aa = dot(a, a), ab = dot(a, b), bb = dot(b, b);
+    float ha = dot(h, a), hb = dot(h, b);
+    float det = aa * bb - ab * ab;
+    if (std::fabs(det) < 1e-12f)
+        return false;
+    s = (ha * bb - hb * ab) / det;
+    t = (hb * aa - ha * ab) / det;
+    return true;
+}
+
+// Determine the relative desktop area (x,y,w,h with origin top left) of a
+// wall or cylinder screen that is visible through the given wall from the
+// eye position. This samples the screen densely and projects the samples,
+// so it works for any screen shape.
+static bool screen_area_in_wall(const eq_init_data& init_data, const float eye[3], const float wall[9],
+        float area[4])
+{
+    const int N = 64;
+    float u0 = 1.0f, v0 = 1.0f, u1 = 0.0f, v1 = 0.0f;
+    for (int j = 0; j <= N; j++) {
+        float v = j / static_cast<float>(N);
+        for (int i = 0; i <= N; i++) {
+            float u = i / static_cast<float>(N);
+            float p[3], s, t;
+            screen_point(init_data, u, v, p);
+            if (project_to_wall(eye, p, wall, s, t)
+                    && s >= 0.0f && s <= 1.0f && t >= 0.0f && t <= 1.0f) {
+                u0 = std::min(u0, u);
+                v0 = std::min(v0, v);
+                u1 = std::max(u1, u);
+                v1 = std::max(v1, v);
+            }
+        }
+    }
+    if (u0 > u1 || v0 > v1)
+        return false;
+    // Add one sample distance to account for the parts between samples
+    u0 = std::max(u0 - 1.0f / N, 0.0f);
+    v0 = std::max(v0 - 1.0f / N, 0.0f);
+    u1 = std::min(u1 + 1.0f / N, 1.0f);
+    v1 = std::min(v1 + 1.0f / N, 1.0f);
+    area[0] = u0;
+    area[1] = v0;
+    area[2] = u1 - u0;
+    area[3] = v1 - v0;
+    return true;
+}
+
+// Convert a relative canvas area (origin bottom left) to a relative desktop
+// area (origin top left), given the canvas layout of the desktop.
+static void canvas_area_to_screen_area(const float canvas[6], const float canvas_area[4], float area[4])
+{
+    area[0] = (canvas_area[0] - canvas[2]) / canvas[4];
+    area[1] = (canvas[3] + canvas[5] - (canvas_area[1] + canvas_area[3])) / canvas[5];
+    area[2] = canvas_area[2] / canvas[4];
+    area[3] = canvas_area[3] / canvas[5];
+}
+
+// Convert a relative area of a wall or cylinder screen to a relative desktop
+// area, given the placement of the desktop on the screen (all origin top
+// left).
+static void screen_area_to_desktop_area(const float placement[4], const float screen_area[4], float area[4])
+{
+    area[0] = (screen_area[0] - placement[0]) / placement[2];
+    area[1] = (screen_area[1] - placement[1]) / placement[3];
+    area[2] = screen_area[2] / placement[2];
+    area[3] = screen_area[3] / placement[3];
+}
+
+// Clamp a relative desktop area to the desktop; the result may be empty.
+static eq::Viewport clamp_desktop_area(const float area[4])
+{
+    float u0 = std::max(area[0], 0.0f);
+    float v0 = std::max(area[1], 0.0f);
+    float u1 = std::min(area[0] + area[2], 1.0f);
+    float v1 = std::min(area[1] + area[3], 1.0f);
+    return eq::Viewport(u0, v0, std::max(u1 - u0, 0.0f), std::max(v1 - v0, 0.0f));
+}
+
+// Determine the relative desktop area (x,y,w,h with origin top left) of a
+// wall or cylinder screen that is inside the view frustum given by the
+// combined projection and modelview matrix.
+static bool screen_area_in_frustum(const eq_init_data& init_data, const float mvp[16], float area[4])
+{
+    const int N = 64;
+    float u0 = 1.0f, v0 = 1.0f, u1 = 0.0f, v1 = 0.0f;
+    for (int j = 0; j <= N; j++) {
+        float v = j / static_cast<float>(N);
+        for (int i = 0; i <= N; i++) {
+            float u = i / static_cast<float>(N);
+            float p[3];
+            screen_point(init_data, u, v, p);
+            float cx = mvp[0] * p[0] + mvp[4] * p[1] + mvp[8] * p[2] + mvp[12];
+            float cy = mvp[1] * p[0] + mvp[5] * p[1] + mvp[9] * p[2] + mvp[13];
+            float cw = mvp[3] * p[0] + mvp[7] * p[1] + mvp[11] * p[2] + mvp[15];
+            if (cw > 0.0f && cx >= -cw && cx <= cw && cy >= -cw && cy <= cw) {
+                u0 = std::min(u0, u);
+                v0 = std::min(v0, v);
+                u1 = std::max(u1, u);
+                v1 = std::max(v1, v);
+            }
+        }
+    }
+    if (u0 > u1 || v0 > v1)
+        return false;
+    // Add one sample distance to account for the parts between samples
+    u0 = std::max(u0 - 1.0f / N, 0.0f);
+    v0 = std::max(v0 - 1.0f / N, 0.0f);
+    u1 = std::min(u1 + 1.0f / N, 1.0f);
+    v1 = std::min(v1 + 1.0f / N, 1.0f);
+    area[0] = u0;
+    area[1] = v0;
+    area[2] = u1 - u0;
+    area[3] = v1 - v0;
+    return true;
+}
+
+// Convert the relative desktop area from u0,v0 to u1,v1 (origin top left)
+// to a rectangle of the desktop framebuffer. A small margin is added for
+// texture filtering at the borders.
+static rectangle_t area_to_rectangle(float u0, float v0, float u1, float v1, int width, int height)
+{
+    rectangle_t r = { 0, 0, 0, 0 };
+    if (u0 >= u1 || v0 >= v1)
+        return r;
+    int x0 = std::max(static_cast<int>(std::floor(u0 * width)) - 2, 0);
+    int y0 = std::max(static_cast<int>(std::floor(v0 * height)) - 2, 0);
+    int x1 = std::min(static_cast<int>(std::ceil(u1 * width)) + 2, width);
+    int y1 = std::min(static_cast<int>(std::ceil(v1 * height)) + 2, height);
+    r.x = x0;
+    r.y = y0;
+    r.w = std::max(x1 - x0, 0);
+    r.h = std::max(y1 - y0, 0);
+    return r;
+}
+
+// Transfer a contiguous block of pixels with a single stream operation
+template<typename T>
+static void write_pixels(co::DataOStream& os, const T* pixels, size_t n)
+{
+#if EQ_VERSION_GE(1,6,0)
+    os << co::Array<T>(const_cast<T*>(pixels), n);
+#else
+    os.write(pixels, n * sizeof(T));
+#endif
+}
+
+template<typename T>
+static void read_pixels(co::DataIStream& is, T* pixels, size_t n)
+{
+#if EQ_VERSION_GE(1,6,0)
+    is >> co::Array<T>(pixels, n);
+#else
+    is.read(pixels, n * sizeof(T));
+#endif
+}
+
+// Streams in memory, so that the benchmark can run the transport code
+// without Equalizer
+class memory_ostream
+{
+public:
+    std::vector<uint8_t> data;
+
+    void write(const void* p, size_t n)
+    {
+        data.insert(data.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + n);
+    }
+};
+
+class memory_istream
+{
+private:
+    const std::vector<uint8_t>& data;
+    size_t pos;
+
+public:
+    memory_istream(const std::vector<uint8_t>& d) : data(d), pos(0)
+    {
+    }
+
+    void read(void* p, size_t n)
+    {
+        std::memcpy(p, &(data[pos]), n);
+        pos += n;
     }
 };
 
+template<typename T>
+static void write_pixels(memory_ostream& os, const T* pixels, size_t n)
+{
+    os.write(pixels, n * sizeof(T));
+}
+
+template<typename T>
+static void read_pixels(memory_istream& is, T* pixels, size_t n)
+{
+    is.read(pixels, n * sizeof(T));
+}
+
+// Pixel conversions for the reduced transport formats. The 8 bit channels
+// are in the usual VNC framebuffer layout 0x00RRGGBB.
+static uint16_t rgb32_to_rgb565(unsigned int p)
+{
+    return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+}
+
+static unsigned int rgb565_to_rgb32(uint16_t p)
+{
+    unsigned int r = (p >> 11) & 0x1f;
+    unsigned int g = (p >> 5) & 0x3f;
+    unsigned int b = p & 0x1f;
+    return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+}
+
+static int clamp_byte(int v)
+{
+    return std::min(std::max(v, 0), 255);
+}
+
+// Full range BT.601 in fixed point
+static void rgb32_to_yuv(unsigned int p, int& y, int& u, int& v)
+{
+    int r = (p >> 16) & 0xff;
+    int g = (p >> 8) & 0xff;
+    int b = p & 0xff;
+    y = (77 * r + 150 * g + 29 * b) >> 8;
+    u = ((-43 * r - 85 * g + 128 * b) >> 8) + 128;
+    v = ((128 * r - 107 * g - 21 * b) >> 8) + 128;
+}
+
+static unsigned int yuv_to_rgb32(int y, int u, int v)
+{
+    u -= 128;
+    v -= 128;
+    int r = clamp_byte(y + ((359 * v) >> 8));
+    int g = clamp_byte(y - ((88 * u + 183 * v) >> 8));
+    int b = clamp_byte(y + ((454 * u) >> 8));
+    return (r << 16) | (g << 8) | b;
+}
+
+// The number of bytes that write_rectangle() writes for a rectangle
+static long long rectangle_bytes(const rectangle_t& r, transport_format_t format)
+{
+    long long pixels = static_cast<long long>(r.w) * r.h;
+    if (format == format_rgb32)
+        return pixels * 4;
+    else if (format == format_rgb565)
+        return pixels * 2;
+    else
+        return pixels + 2 * static_cast<long long>((r.w + 1) / 2) * ((r.h + 1) / 2);
+}
+
+// Convert the rows y0 to y1 (relative to r; y0 must be even) of the
+// rectangle r of the framebuffer fb with the given width to the given
+// transport format. The result goes to the parts of buf that belong to these
+// rows; buf holds rectangle_bytes() bytes for the whole rectangle. With
+// encoding_xor, the pixels are XORed with the reference ref, in the
+// transport format. YUV 4:2:0 does not support encoding_xor.
+static void encode_rows(const unsigned int* fb, const unsigned int* ref, int width,
+        const rectangle_t& r, int y0, int y1, transport_format_t format, encoding_t encoding, uint8_t* buf)
+{
+    if (format == format_rgb32) {
+        unsigned int* out = reinterpret_cast<unsigned int*>(buf);
+        for (int y = y0; y < y1; y++) {
+            const unsigned int* p = fb + (r.y + y) * width + r.x;
+            unsigned int* o = out + y * r.w;
+            if (encoding == encoding_xor) {
+                const unsigned int* q = ref + (r.y + y) * width + r.x;
+                for (int x = 0; x < r.w; x++)
+                    o[x] = p[x] ^ q[x];
+            } else {
+                std::memcpy(o, p, r.w * sizeof(unsigned int));
+            }
+        }
+    } else if (format == format_rgb565) {
+        uint16_t* out = reinterpret_cast<uint16_t*>(buf);
+        for (int y = y0; y < y1; y++) {
+            const unsigned int* p = fb + (r.y + y) * width + r.x;
+            uint16_t* o = out + y * r.w;
+            if (encoding == encoding_xor) {
+                const unsigned int* q = ref + (r.y + y) * width + r.x;
+                for (int x = 0; x < r.w; x++)
+                    o[x] = rgb32_to_rgb565(p[x]) ^ rgb32_to_rgb565(q[x]);
+            } else {
+                for (int x = 0; x < r.w; x++)
+                    o[x] = rgb32_to_rgb565(p[x]);
+            }
+        }
+    } else {
+        int cw = (r.w + 1) / 2;
+        int ch = (r.h + 1) / 2;
+        uint8_t* py = buf;
+        uint8_t* pu = py + r.w * r.h;
+        uint8_t* pv = pu + cw * ch;
+        for (int j = y0 / 2; j < std::min((y1 + 1) / 2, ch); j++) {
+            for (int i = 0; i < cw; i++) {
+                int su = 0, sv = 0, n = 0;
+                for (int y = r.y + 2 * j; y < std::min(r.y + 2 * j + 2, r.y + r.h); y++) {
+                    for (int x = r.x + 2 * i; x < std::min(r.x + 2 * i + 2, r.x + r.w); x++) {
+                        int Y, U, V;
+                        rgb32_to_yuv(fb[y * width + x], Y, U, V);
+                        py[(y - r.y) * r.w + (x - r.x)] = Y;
+                        su += U;
+                        sv += V;
+                        n++;
+                    }
+                }
+                pu[j * cw + i] = (su + n / 2) / n;
+                pv[j * cw + i] = (sv + n / 2) / n;
+            }
+        }
+    }
+}
+
+// Whether a rectangle must be converted before it is written. Plain 32 bit
+// pixels are written directly from the framebuffer.
+static bool needs_encoding(transport_format_t format, encoding_t encoding)
+{
+    return format != format_rgb32 || encoding != encoding_raw;
+}
+
+// Convert the rectangles that need it for write_rectangle(). This runs in
+// parallel if OpenMP is available (see OMP_NUM_THREADS); the work is split
+// into bands of rows so that a single large rectangle also uses all
+// threads. The result is the same as converting each rectangle by itself.
+static void encode_rectangles(const unsigned int* fb, const unsigned int* ref, int width,
+        const std::vector<rectangle_t>& rectangles, const std::vector<encoding_t>& encodings,
+        const std::vector<transport_format_t>& formats, std::vector<std::vector<uint8_t> >& encoded)
+{
+    const int band_rows = 32;
+    std::vector<size_t> band_rectangle;
+    std::vector<int> band_y;
+    encoded.resize(rectangles.size());
+    for (size_t i = 0; i < rectangles.size(); i++) {
+        const rectangle_t& r = rectangles[i];
+        encoded[i].clear();
+        if (r.w <= 0 || r.h <= 0 || !needs_encoding(formats[i], encodings[i]))
+            continue;
+        encoded[i].resize(rectangle_bytes(r, formats[i]));
+        for (int y = 0; y < r.h; y += band_rows) {
+            band_rectangle.push_back(i);
+            band_y.push_back(y);
+        }
+    }
+    const int bands = band_rectangle.size();
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < bands; b++) {
+        size_t i = band_rectangle[b];
+        const rectangle_t& r = rectangles[i];
+        encode_rows(fb, ref, width, r, band_y[b], std::min(band_y[b] + band_rows, r.h),
+                formats[i], encodings[i], &(encoded[i][0]));
+    }
+}
+
+// Write the rectangle r of the framebuffer fb with the given width in the
+// given transport format. If the rectangle needs to be converted, encoded
+// holds the result of encode_rectangles() for it.
+template<typename S>
+static void write_rectangle(S& os, const unsigned int* fb, int width, const rectangle_t& r,
+        transport_format_t format, encoding_t encoding, const std::vector<uint8_t>& encoded)
+{
+    if (!needs_encoding(format, encoding)) {
+        if (r.x == 0 && r.w == width) {
+            // Full-width rectangles are contiguous in the framebuffer
+            write_pixels(os, fb + r.y * width, r.w * r.h);
+        } else {
+            for (int y = r.y; y < r.y + r.h; y++)
+                write_pixels(os, fb + y * width + r.x, r.w);
+        }
+    } else if (format == format_rgb32) {
+        write_pixels(os, reinterpret_cast<const unsigned int*>(&(encoded[0])), encoded.size() / sizeof(unsigned int));
+    } else if (format == format_rgb565) {
+        write_pixels(os, reinterpret_cast<const uint16_t*>(&(encoded[0])), encoded.size() / sizeof(uint16_t));
+    } else {
+        write_pixels(os, &(encoded[0]), encoded.size());
+    }
+}
+
+// Read a rectangle written by write_rectangle() into the framebuffer fb.
+// With encoding_xor, fb must hold the reference contents.
+template<typename S>
+static void read_rectangle(S& is, unsigned int* fb, int width,
+        const rectangle_t& r, transport_format_t format, encoding_t encoding)
+{
+    if (format == format_rgb32) {
+        if (encoding == encoding_xor) {
+            std::vector<unsigned int> row(r.w);
+            for (int y = r.y; y < r.y + r.h; y++) {
+                read_pixels(is, &(row[0]), r.w);
+                unsigned int* p = fb + y * width + r.x;
+                for (int x = 0; x < r.w; x++)
+                    p[x] ^= row[x];
+            }
+        } else if (r.x == 0 && r.w == width) {
+            read_pixels(is, fb + r.y * width, r.w * r.h);
+        } else {
+            for (int y = r.y; y < r.y + r.h; y++)
+                read_pixels(is, fb + y * width + r.x, r.w);
+        }
+    } else if (format == format_rgb565) {
+        // RGB565 values survive the round trip through 32 bit, so the XOR
+        // reference can be recovered from the framebuffer.
+        std::vector<uint16_t> row(r.w);
+        for (int y = r.y; y < r.y + r.h; y++) {
+            read_pixels(is, &(row[0]), r.w);
+            unsigned int* p = fb + y * width + r.x;
+            for (int x = 0; x < r.w; x++)
+                p[x] = rgb565_to_rgb32(row[x] ^ (encoding == encoding_xor ? rgb32_to_rgb565(p[x]) : 0));
+        }
+    } else {
+        int cw = (r.w + 1) / 2;
+        int ch = (r.h + 1) / 2;
+        std::vector<uint8_t> planes(r.w * r.h + 2 * cw * ch);
+        read_pixels(is, &(planes[0]), planes.size());
+        const uint8_t* py = &(planes[0]);
+        const uint8_t* pu = py + r.w * r.h;
+        const uint8_t* pv = pu + cw * ch;
+        for (int y = 0; y < r.h; y++) {
+            unsigned int* p = fb + (r.y + y) * width + r.x;
+            for (int x = 0; x < r.w; x++)
+                p[x] = yuv_to_rgb32(py[y * r.w + x], pu[(y / 2) * cw + x / 2], pv[(y / 2) * cw + x / 2]);
+        }
+    }
+}
+
+// The state of a desktop tile for the detection of video regions
+typedef struct {
+    int updates;        // frames that changed the tile in the current second
+    int busy_seconds;   // consecutive seconds with many updates
+    bool video;         // whether the tile is sent as video
+    bool lossy;         // whether the render nodes have a lossy version
+} video_tile_t;
+
+// A tile that changes in at least video_min_updates frames per second for
+// video_min_seconds seconds is treated as video.
+static const int video_tile_size = 64;
+static const int video_min_updates = 10;
+static const int video_min_seconds = 2;
+
+// The rectangles that one frame changed on a render node
+typedef struct {
+    uint32_t frame_number;
+    std::vector<rectangle_t> rectangles;
+} frame_changes_t;
+
+// The number of frames for which the render nodes remember the changes
+static const size_t frame_history_length = 16;
+
 class eq_frame_data : public co::Object
 {
 public:
     int vnc_width;
     int vnc_height;
     float canvas[6]; // width, height, and relative rectangle x,y,w,h
+    // The relative area of the screen (x,y,w,h with origin top left) that
+    // shows this desktop. With --screen=canvas, the desktop is placed within
+    // this area keeping its aspect ratio, as given by canvas.
+    float placement[4];
     std::vector<unsigned int> vnc_framebuffer; // 32 bit BGRA pixels
     std::vector<rectangle_t> vnc_dirty_rectangles;
+    // Copy operations are applied before the dirty rectangles are updated.
+    // The source of a copy never overlaps a dirty rectangle that precedes it
+    // in the same frame; such copies are sent as dirty rectangles instead.
+    std::vector<copy_rectangle_t> vnc_copy_rectangles;
+    // The cursor shape and position if the cursor is drawn as an overlay;
+    // cursor.w is 0 otherwise. On the application node, the shape is only
+    // sent when cursor_shape_changed is set. On the render nodes,
+    // cursor_version counts the received shapes.
+    cursor_t cursor;
+    int cursor_x, cursor_y;
+    bool cursor_shape_changed;
+    int cursor_version;
+    // Only used on the application node in --roi mode: this object then
+    // distributes the dirty rectangles of the source object, clipped to the
+    // region.
+    const eq_frame_data* source;
+    bool has_region;
+    rectangle_t region;
+    // Only used on the application node: transport options
+    transport_format_t format;
+    bool has_compressor;
+    uint32_t compressor;
+    bool use_delta;
+    // Only used on the application node with use_delta: the framebuffer
+    // contents as known to the render nodes after the last frame, with the
+    // copy operations of the current frame applied.
+    std::vector<unsigned int> vnc_reference;
+    int vnc_reference_width, vnc_reference_height;
+    // Only used on the application node: send the complete framebuffer
+    // instead of the changes, for pipes that mapped the object late.
+    bool keyframe;
+    // Only used on the application node with detect_video: the tiles of
+    // video_tile_size pixels, and how each dirty rectangle is sent (empty
+    // if all are dirty_changes).
+    bool detect_video;
+    int video_tiles_w, video_tiles_h;
+    std::vector<video_tile_t> video_tiles;
+    lunchbox::Clock video_clock;
+    std::vector<dirty_kind_t> vnc_dirty_kinds;
+    // Only used on the application node: the number of rectangles and pixel
+    // data bytes sent by the last commit.
+    int sent_rectangles;
+    long long sent_bytes;
+    // The statistics overlay text, empty if there is none
+    std::string stats_text;
+    // Only used on the render nodes: the changes of the last frames (dirty
+    // rectangles and copy destinations), oldest first, so that a window
+    // that missed frames only needs to upload what changed since.
+    std::deque<frame_changes_t> history;
+
+    eq_frame_data() : vnc_width(0), vnc_height(0),
+        cursor_x(0), cursor_y(0), cursor_shape_changed(false), cursor_version(0),
+        source(NULL), has_region(false),
+        format(format_rgb32), has_compressor(false), compressor(0), use_delta(false),
+        vnc_reference_width(0), vnc_reference_height(0), keyframe(false),
+        detect_video(false), video_tiles_w(0), video_tiles_h(0),
+        sent_rectangles(0), sent_bytes(0)
+    {
+        placement[0] = placement[1] = 0.0f;
+        placement[2] = placement[3] = 1.0f;
+        cursor.hot_x = cursor.hot_y = cursor.w = cursor.h = 0;
+    }
+
+    // On the application node, find the tiles that change so often that
+    // they probably show a video, and send their changes in YUV 4:2:0. This
+    // splits the dirty rectangles at the borders of these tiles. A tile that
+    // stops being video is sent once more without loss. Copies from tiles
+    // that the render nodes only have in lossy form become dirty rectangles,
+    // and delta encoding is not used there, because the reference does not
+    // match the render nodes. Call this before prepare_reference().
+    void classify_video()
+    {
+        vnc_dirty_kinds.clear();
+        if (!detect_video)
+            return;
+        int tw = (vnc_width + video_tile_size - 1) / video_tile_size;
+        int th = (vnc_height + video_tile_size - 1) / video_tile_size;
+        if (tw != video_tiles_w || th != video_tiles_h) {
+            video_tile_t t = { 0, 0, false, false };
+            video_tiles.assign(tw * th, t);
+            video_tiles_w = tw;
+            video_tiles_h = th;
+        }
+        std::vector<char> touched(video_tiles.size(), 0);
+        for (size_t i = 0; i < vnc_dirty_rectangles.size(); i++)
+            mark_video_tiles(vnc_dirty_rectangles[i], touched);
+        for (size_t i = 0; i < vnc_copy_rectangles.size(); i++) {
+            const copy_rectangle_t& c = vnc_copy_rectangles[i];
+            rectangle_t r = { c.x, c.y, c.w, c.h };
+            mark_video_tiles(r, touched);
+        }
+        for (size_t i = 0; i < video_tiles.size(); i++)
+            video_tiles[i].updates += touched[i];
+        if (video_clock.getTimef() >= 1000.0f) {
+            video_clock.reset();
+            for (size_t i = 0; i < video_tiles.size(); i++) {
+                video_tile_t& t = video_tiles[i];
+                t.busy_seconds = (t.updates >= video_min_updates ? t.busy_seconds + 1 : 0);
+                t.video = (t.busy_seconds >= video_min_seconds);
+                t.updates = 0;
+            }
+        }
+        if (keyframe) {
+            // The complete framebuffer is sent without loss
+            for (size_t i = 0; i < video_tiles.size(); i++)
+                video_tiles[i].lossy = false;
+            return;
+        }
+        std::vector<copy_rectangle_t> copies;
+        std::vector<rectangle_t> copy_destinations;
+        for (size_t i = 0; i < vnc_copy_rectangles.size(); i++) {
+            const copy_rectangle_t& c = vnc_copy_rectangles[i];
+            rectangle_t src = { c.src_x, c.src_y, c.w, c.h };
+            rectangle_t dst = { c.x, c.y, c.w, c.h };
+            if (overlaps_lossy_tile(src) || overlaps_any(src, copy_destinations))
+                copy_destinations.push_back(dst);
+            else
+                copies.push_back(c);
+        }
+        vnc_copy_rectangles.swap(copies);
+        for (size_t i = 0; i < copy_destinations.size(); i++)
+            add_dirty_rectangle(vnc_dirty_rectangles, copy_destinations[i]);
+        std::vector<rectangle_t> rectangles;
+        for (size_t i = 0; i < vnc_dirty_rectangles.size(); i++)
+            split_at_video_tiles(vnc_dirty_rectangles[i], rectangles, vnc_dirty_kinds);
+        for (int ty = 0; ty < video_tiles_h; ty++) {
+            for (int tx = 0; tx < video_tiles_w; tx++) {
+                video_tile_t& t = video_tiles[ty * video_tiles_w + tx];
+                if (t.lossy && !t.video) {
+                    rectangle_t r = { tx * video_tile_size, ty * video_tile_size,
+                        std::min(video_tile_size, vnc_width - tx * video_tile_size),
+                        std::min(video_tile_size, vnc_height - ty * video_tile_size) };
+                    rectangles.push_back(r);
+                    vnc_dirty_kinds.push_back(dirty_refresh);
+                    t.lossy = false;
+                }
+            }
+        }
+        vnc_dirty_rectangles.swap(rectangles);
+    }
+
+    // Whether the render nodes have lossy tiles, which need to be refreshed
+    // once they stop changing
+    bool video_refresh_pending() const
+    {
+        for (size_t i = 0; i < video_tiles.size(); i++) {
+            if (video_tiles[i].lossy)
+                return true;
+        }
+        return false;
+    }
+
+    // Call this before committing the frame data objects of a frame...
+    void prepare_reference()
+    {
+        if (!reference_valid())
+            return;
+        for (size_t i = 0; i < vnc_copy_rectangles.size(); i++)
+            copy_pixels(&(vnc_reference[0]), vnc_width, vnc_copy_rectangles[i]);
+    }
+
+    // ... and this after all of them were committed.
+    void update_reference()
+    {
+        if (!use_delta)
+            return;
+        if (!reference_valid() || keyframe) {
+            vnc_reference = vnc_framebuffer;
+            vnc_reference_width = vnc_width;
+            vnc_reference_height = vnc_height;
+            return;
+        }
+        for (size_t i = 0; i < vnc_dirty_rectangles.size(); i++) {
+            const rectangle_t& r = vnc_dirty_rectangles[i];
+            for (int y = r.y; y < r.y + r.h; y++)
+                std::memcpy(&(vnc_reference[y * vnc_width + r.x]),
+                        &(vnc_framebuffer[y * vnc_width + r.x]), r.w * sizeof(unsigned int));
+        }
+    }
+
+    bool reference_valid() const
+    {
+        return use_delta && vnc_reference_width == vnc_width && vnc_reference_height == vnc_height;
+    }
+
+    // Call this on the render nodes after each sync(), with the number of
+    // the frame that the synced version belongs to.
+    void record_changes(uint32_t frame_number)
+    {
+        if (history.size() >= frame_history_length)
+            history.pop_front();
+        history.push_back(frame_changes_t());
+        frame_changes_t& changes = history.back();
+        changes.frame_number = frame_number;
+        changes.rectangles = vnc_dirty_rectangles;
+        for (size_t i = 0; i < vnc_copy_rectangles.size(); i++) {
+            const copy_rectangle_t& c = vnc_copy_rectangles[i];
+            rectangle_t r = { c.x, c.y, c.w, c.h };
+            add_dirty_rectangle(changes.rectangles, r);
+        }
+    }
+
+    // Get the rectangles that changed after the given frame, up to the
+    // current one. Returns false if the history does not reach back that
+    // far.
+    bool changes_since(uint32_t frame_number, std::vector<rectangle_t>& rectangles) const
+    {
+        rectangles.clear();
+        if (history.empty() || history.front().frame_number > frame_number + 1)
+            return false;
+        for (size_t i = 0; i < history.size(); i++) {
+            if (history[i].frame_number <= frame_number)
+                continue;
+            for (size_t j = 0; j < history[i].rectangles.size(); j++)
+                add_dirty_rectangle(rectangles, history[i].rectangles[j]);
+        }
+        return true;
+    }
+
+private:
+    // The range of video tiles covered by a rectangle; false if empty
+    bool get_video_tiles(const rectangle_t& r, int& tx0, int& ty0, int& tx1, int& ty1) const
+    {
+        if (r.w <= 0 || r.h <= 0)
+            return false;
+        tx0 = std::max(r.x / video_tile_size, 0);
+        ty0 = std::max(r.y / video_tile_size, 0);
+        tx1 = std::min((r.x + r.w - 1) / video_tile_size, video_tiles_w - 1);
+        ty1 = std::min((r.y + r.h - 1) / video_tile_size, video_tiles_h - 1);
+        return tx0 <= tx1 && ty0 <= ty1;
+    }
+
+    void mark_video_tiles(const rectangle_t& r, std::vector<char>& touched) const
+    {
+        int tx0, ty0, tx1, ty1;
+        if (!get_video_tiles(r, tx0, ty0, tx1, ty1))
+            return;
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++)
+                touched[ty * video_tiles_w + tx] = 1;
+    }
+
+    bool overlaps_lossy_tile(const rectangle_t& r) const
+    {
+        int tx0, ty0, tx1, ty1;
+        if (!get_video_tiles(r, tx0, ty0, tx1, ty1))
+            return false;
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++)
+                if (video_tiles[ty * video_tiles_w + tx].lossy)
+                    return true;
+        return false;
+    }
+
+    // The kind of the changes in a tile; -1 if the tile is refreshed
+    // completely anyway
+    int video_tile_kind(int tx, int ty) const
+    {
+        const video_tile_t& t = video_tiles[ty * video_tiles_w + tx];
+        return t.video ? dirty_video : t.lossy ? -1 : dirty_changes;
+    }
 
-    eq_frame_data() : vnc_width(0), vnc_height(0)
+    // Append the parts of r to rectangles, with one part per row of tiles
+    // and run of tiles of the same kind. Video tiles become lossy.
+    void split_at_video_tiles(const rectangle_t& r,
+            std::vector<rectangle_t>& rectangles, std::vector<dirty_kind_t>& kinds)
     {
+        int tx0, ty0, tx1, ty1;
+        if (!get_video_tiles(r, tx0, ty0, tx1, ty1))
+            return;
+        bool uniform = true;
+        for (int ty = ty0; uniform && ty <= ty1; ty++)
+            for (int tx = tx0; uniform && tx <= tx1; tx++)
+                uniform = (video_tile_kind(tx, ty) == dirty_changes);
+        if (uniform) {
+            rectangles.push_back(r);
+            kinds.push_back(dirty_changes);
+            return;
+        }
+        for (int ty = ty0; ty <= ty1; ty++) {
+            int y0 = std::max(r.y, ty * video_tile_size);
+            int y1 = std::min(r.y + r.h, (ty + 1) * video_tile_size);
+            int tx = tx0;
+            while (tx <= tx1) {
+                int kind = video_tile_kind(tx, ty);
+                int run_end = tx;
+                while (run_end + 1 <= tx1 && video_tile_kind(run_end + 1, ty) == kind)
+                    run_end++;
+                if (kind >= 0) {
+                    int x0 = std::max(r.x, tx * video_tile_size);
+                    int x1 = std::min(r.x + r.w, (run_end + 1) * video_tile_size);
+                    rectangle_t part = { x0, y0, x1 - x0, y1 - y0 };
+                    rectangles.push_back(part);
+                    kinds.push_back(static_cast<dirty_kind_t>(kind));
+                    for (int i = tx; kind == dirty_video && i <= run_end; i++)
+                        video_tiles[ty * video_tiles_w + i].lossy = true;
+                }
+                tx = run_end + 1;
+            }
+        }
     }
 
 protected:
@@ -145,25 +2198,114 @@ protected:
         return co::Object::INSTANCE;
     }
 
+    virtual uint32_t chooseCompressor() const
+    {
+        return has_compressor ? compressor : co::Object::chooseCompressor();
+    }
+
     virtual void getInstanceData(co::DataOStream& os)
     {
-        os << vnc_width << vnc_height;
+        const eq_frame_data& src = (source ? *source : *this);
+        os << src.vnc_width << src.vnc_height;
+        float c[6];
+        std::memcpy(c, src.canvas, sizeof(c));
+        float p[4];
+        std::memcpy(p, src.placement, sizeof(p));
 #if EQ_VERSION_GE(1,6,0)
-        os << co::Array<float>(canvas, 6);
+        os << co::Array<float>(c, 6);
+        os << co::Array<float>(p, 4);
 #else
-        os.write(canvas, 6 * sizeof(float));
+        os.write(c, 6 * sizeof(float));
+        os.write(p, 4 * sizeof(float));
 #endif
-        size_t n = vnc_dirty_rectangles.size();
+        os << src.cursor_x << src.cursor_y;
+        bool send_cursor_shape = src.cursor_shape_changed || src.keyframe;
+        os << send_cursor_shape;
+        if (send_cursor_shape) {
+            os << src.cursor.hot_x << src.cursor.hot_y << src.cursor.w << src.cursor.h;
+            if (src.cursor.w > 0 && src.cursor.h > 0)
+                write_pixels(os, &(src.cursor.pixels[0]), src.cursor.w * src.cursor.h);
+        }
+        std::vector<copy_rectangle_t> copies;
+        std::vector<rectangle_t> rectangles;
+        std::vector<encoding_t> encodings;
+        std::vector<transport_format_t> formats;
+        // Delta encoding is only possible where the receiver's framebuffer
+        // is known to match the reference.
+        const encoding_t encoding = (src.reference_valid() && src.format != format_yuv420)
+            ? encoding_xor : encoding_raw;
+        if (src.keyframe) {
+            // The receiver's framebuffer is unknown, so neither copies nor
+            // delta encoding can be used.
+            rectangle_t full = { 0, 0, src.vnc_width, src.vnc_height };
+            rectangle_t r = full;
+            if (!has_region || clip_rectangle(full, region, r)) {
+                rectangles.push_back(r);
+                encodings.push_back(encoding_raw);
+                formats.push_back(src.format);
+            }
+        }
+        for (size_t i = 0; !src.keyframe && i < src.vnc_copy_rectangles.size(); i++) {
+            copy_rectangle_t c = src.vnc_copy_rectangles[i];
+            if (has_region) {
+                // Copy only the visible part of the destination, and only if
+                // its source is available to the receiver
+                rectangle_t dst = { c.x, c.y, c.w, c.h };
+                rectangle_t r;
+                if (!clip_rectangle(dst, region, r))
+                    continue;
+                c.src_x += r.x - c.x;
+                c.src_y += r.y - c.y;
+                c.x = r.x;
+                c.y = r.y;
+                c.w = r.w;
+                c.h = r.h;
+                rectangle_t csrc = { c.src_x, c.src_y, c.w, c.h };
+                rectangle_t tmp;
+                if (!clip_rectangle(csrc, region, tmp) || tmp.w != csrc.w || tmp.h != csrc.h) {
+                    // The receiver does not apply this copy, so its
+                    // framebuffer differs from the reference here
+                    rectangles.push_back(r);
+                    encodings.push_back(encoding_raw);
+                    formats.push_back(src.format);
+                    continue;
+                }
+            }
+            copies.push_back(c);
+        }
+        for (size_t i = 0; !src.keyframe && i < src.vnc_dirty_rectangles.size(); i++) {
+            rectangle_t r = src.vnc_dirty_rectangles[i];
+            if (!has_region || clip_rectangle(src.vnc_dirty_rectangles[i], region, r)) {
+                dirty_kind_t kind = (i < src.vnc_dirty_kinds.size() ? src.vnc_dirty_kinds[i] : dirty_changes);
+                rectangles.push_back(r);
+                encodings.push_back(kind == dirty_changes ? encoding : encoding_raw);
+                formats.push_back(kind == dirty_video ? format_yuv420 : src.format);
+            }
+        }
+        size_t m = copies.size();
+        os << m;
+        for (size_t i = 0; i < m; i++) {
+            const copy_rectangle_t& c = copies[i];
+            os << c.src_x << c.src_y << c.x << c.y << c.w << c.h;
+        }
+        size_t n = rectangles.size();
         os << n;
+        sent_rectangles = 0;
+        sent_bytes = 0;
+        std::vector<std::vector<uint8_t> > encoded;
+        encode_rectangles(&(src.vnc_framebuffer[0]), src.reference_valid() ? &(src.vnc_reference[0]) : NULL,
+                src.vnc_width, rectangles, encodings, formats, encoded);
         for (size_t i = 0; i < n; i++) {
-            rectangle_t r = vnc_dirty_rectangles[i];
+            rectangle_t r = rectangles[i];
             os << r.x << r.y << r.w << r.h;
-            for (int y = r.y; y < r.y + r.h; y++) {
-                for (int x = r.x; x < r.x + r.w; x++) {
-                    os << vnc_framebuffer[y * vnc_width + x];
-                }
-            }
+            os << static_cast<int>(encodings[i]) << static_cast<int>(formats[i]);
+            if (r.w <= 0 || r.h <= 0)
+                continue;
+            write_rectangle(os, &(src.vnc_framebuffer[0]), src.vnc_width, r, formats[i], encodings[i], encoded[i]);
+            sent_rectangles++;
+            sent_bytes += rectangle_bytes(r, formats[i]);
         }
+        os << src.stats_text;
     }
 
     virtual void applyInstanceData(co::DataIStream& is)
@@ -176,20 +2318,58 @@ protected:
         vnc_height = h;
 #if EQ_VERSION_GE(1,6,0)
         is >> co::Array<float>(canvas, 6);
+        is >> co::Array<float>(placement, 4);
 #else
         is.read(canvas, 6 * sizeof(float));
+        is.read(placement, 4 * sizeof(float));
 #endif
+        is >> cursor_x >> cursor_y;
+        bool got_cursor_shape;
+        is >> got_cursor_shape;
+        if (got_cursor_shape) {
+            is >> cursor.hot_x >> cursor.hot_y >> cursor.w >> cursor.h;
+            cursor.pixels.resize(std::max(cursor.w * cursor.h, 0));
+            if (cursor.w > 0 && cursor.h > 0)
+                read_pixels(is, &(cursor.pixels[0]), cursor.w * cursor.h);
+            cursor_version++;
+        }
+        size_t m;
+        is >> m;
+        for (size_t i = 0; i < m; i++) {
+            copy_rectangle_t c;
+            is >> c.src_x >> c.src_y >> c.x >> c.y >> c.w >> c.h;
+            if (!copy_rectangle_valid(c, vnc_width, vnc_height))
+                continue;
+            copy_pixels(&(vnc_framebuffer[0]), vnc_width, c);
+            // If several versions are applied in one sync(), the source of
+            // this copy might depend on pixels of an earlier version that
+            // are not yet in the texture. Let eq_window upload the result
+            // instead of copying on the GPU in this case.
+            rectangle_t csrc = { c.src_x, c.src_y, c.w, c.h };
+            if (overlaps_any(csrc, vnc_dirty_rectangles)) {
+                rectangle_t r = { c.x, c.y, c.w, c.h };
+                add_dirty_rectangle(vnc_dirty_rectangles, r);
+            } else {
+                vnc_copy_rectangles.push_back(c);
+            }
+        }
         size_t n;
         is >> n;
         for (size_t i = 0; i < n; i++) {
             rectangle_t r;
+            int encoding, format;
             is >> r.x >> r.y >> r.w >> r.h;
-            for (int y = r.y; y < r.y + r.h; y++) {
-                for (int x = r.x; x < r.x + r.w; x++) {
-                    is >> vnc_framebuffer[y * vnc_width + x];
-                }
-            }
+            is >> encoding >> format;
+            if (r.w <= 0 || r.h <= 0)
+                continue;
+            // Remember the rectangle so that eq_window can upload only the
+            // parts of the texture that changed. eq_node clears the lists
+            // before each sync().
+            add_dirty_rectangle(vnc_dirty_rectangles, r);
+            read_rectangle(is, &(vnc_framebuffer[0]), vnc_width, r,
+                    static_cast<transport_format_t>(format), static_cast<encoding_t>(encoding));
         }
+        is >> stats_text;
     }
 };
 
@@ -244,7 +2424,9 @@ static rfbKeySym eqkey_to_rfbkey(eq::KeyEvent key)
     return k;
 }
 
-static void eqptr_to_rfbptr(const eq::PointerEvent& e,
+// Convert a pointer event on the canvas to a VNC pointer event. Returns
+// whether the pointer is on the desktop.
+static bool eqptr_to_rfbptr(const eq::PointerEvent& e,
         const eq::PixelViewport& pvp, const eq::Viewport& vp,
         const float canvas[6], int vnc_width, int vnc_height,
         int& x, int& y, int& buttons)
@@ -255,10 +2437,11 @@ static void eqptr_to_rfbptr(const eq::PointerEvent& e,
     // Event position relative to canvas
     float event_canvas_x = vp.x + event_channel_x * vp.w;
     float event_canvas_y = vp.y + ((1.0f - event_channel_y) * vp.h);
-    event_canvas_y = 1.0f - event_canvas_y;
-    // Event position relative to canvas drawing area
+    // Event position relative to canvas drawing area (origin top left)
     float event_canvas_area_x = (event_canvas_x - canvas[2]) / canvas[4];
-    float event_canvas_area_y = (event_canvas_y - canvas[3]) / canvas[5];
+    float event_canvas_area_y = (canvas[3] + canvas[5] - event_canvas_y) / canvas[5];
+    bool inside = (event_canvas_area_x >= 0.0f && event_canvas_area_x < 1.0f
+            && event_canvas_area_y >= 0.0f && event_canvas_area_y < 1.0f);
     // Event pixel position in VNC
     float event_x = event_canvas_area_x * vnc_width;
     float event_y = event_canvas_area_y * vnc_height;
@@ -287,23 +2470,354 @@ static void eqptr_to_rfbptr(const eq::PointerEvent& e,
         buttons |= rfbWheelDownMask;
     //fprintf(stderr, "MOUSE: (%d,%d) in (%dx%d) channel to (%d,%d) in (%dx%d) VNC with buttons %d\n",
     //        e.x, e.y, pvp.w, pvp.h, x, y, vnc_width, vnc_height, buttons);
+    return inside;
 }
 
+// Events sent from the render nodes to the application node
+static const uint32_t event_keyframe_request = eq::Event::USER + 0;
+static const uint32_t event_pipe_stats = eq::Event::USER + 1;
+
+// The statistics of a pipe for one frame, sent with event_pipe_stats. This
+// must fit into the user data of an eq::Event (EQ_USER_EVENT_SIZE, 32 bytes
+// in Equalizer 1.x), so longer pipe names are truncated.
+typedef struct {
+    uint32_t frame_number;
+    float sync_time;            // ms to sync the frame data
+    float upload_time;          // ms to update the textures (on the CPU side)
+    uint32_t upload_bytes;
+    char name[16];              // the pipe name from the Equalizer configuration
+} pipe_stats_t;
+
+// Compile-time check that pipe_stats_t fits into the event
+typedef char pipe_stats_fits_into_event[
+    sizeof(pipe_stats_t) <= sizeof(static_cast<eq::ConfigEvent*>(0)->data.user.data) ? 1 : -1];
+
+// Statistics accumulated on the application node since the last summary
+typedef struct {
+    int frames;
+    int vnc_messages;
+    float vnc_decode_time;
+    long long rectangles;
+    long long bytes;
+    float commit_time;
+    float max_sync_time;        // the slowest pipe in any frame
+    float max_upload_time;
+    long long upload_bytes;     // summed over all pipes
+    std::string slowest_pipe;
+} stats_summary_t;
+
 class eq_config : public eq::Config
 {
+private:
+    // In --roi mode: one frame data object per render node, and the areas
+    // covered by the segments of that node (relative canvas areas for
+    // screen_canvas, relative screen areas otherwise).
+    std::vector<eq_frame_data*> roi_frame_data;
+    std::vector<std::vector<eq::Viewport> > roi_areas;
+
+    bool init_roi()
+    {
+        const eq::Canvas* canvas = getCanvases()[0];
+        const eq::Segments& segments = canvas->getSegments();
+        const float eye[3] = { init_data.head_matrix[12], init_data.head_matrix[13], init_data.head_matrix[14] };
+        for (size_t i = 0; i < segments.size(); i++) {
+            eq::Segment* segment = segments[i];
+            eq::Channel* channel = segment->getChannel();
+            if (!channel)
+                continue;
+            const eq::uint128_t node_id = channel->getNode()->getID();
+            size_t k = 0;
+            while (k < init_data.roi_node_ids.size() && init_data.roi_node_ids[k] != node_id)
+                k++;
+            if (k == init_data.roi_node_ids.size()) {
+                eq_frame_data* fd = new eq_frame_data;
+                fd->source = frame_data[0];
+                fd->has_compressor = frame_data[0]->has_compressor;
+                fd->compressor = frame_data[0]->compressor;
+                fd->has_region = true;
+                fd->region.x = fd->region.y = fd->region.w = fd->region.h = 0;
+                if (!registerObject(fd)) {
+                    delete fd;
+                    return false;
+                }
+                roi_frame_data.push_back(fd);
+                roi_areas.push_back(std::vector<eq::Viewport>());
+                init_data.roi_node_ids.push_back(node_id);
+                init_data.roi_frame_data_ids.push_back(fd->getID());
+            }
+            const eq::Viewport& vp = segment->getViewport();
+            if (init_data.screen == screen_canvas) {
+                roi_areas[k].push_back(vp);
+            } else {
+                // Determine the wall of this segment and the part of the
+                // screen that is visible through it
+                const eq::Wall& cw = canvas->getWall();
+                const eq::Wall& sw = segment->getWall();
+                float wall[9];
+                if (segment->getCurrentType() != eq::fabric::Frustum::TYPE_NONE) {
+                    for (int j = 0; j < 3; j++) {
+                        wall[0 + j] = sw.bottomLeft[j];
+                        wall[3 + j] = sw.bottomRight[j];
+                        wall[6 + j] = sw.topLeft[j];
+                    }
+                } else {
+                    for (int j = 0; j < 3; j++) {
+                        float bl = cw.bottomLeft[j];
+                        float dx = cw.bottomRight[j] - bl;
+                        float dy = cw.topLeft[j] - bl;
+                        wall[0 + j] = bl + vp.x * dx + vp.y * dy;
+                        wall[3 + j] = bl + (vp.x + vp.w) * dx + vp.y * dy;
+                        wall[6 + j] = bl + vp.x * dx + (vp.y + vp.h) * dy;
+                    }
+                }
+                float area[4];
+                if (screen_area_in_wall(init_data, eye, wall, area))
+                    roi_areas[k].push_back(eq::Viewport(area[0], area[1], area[2], area[3]));
+            }
+        }
+        return true;
+    }
+
+    void update_roi_regions()
+    {
+        for (size_t k = 0; k < roi_frame_data.size(); k++) {
+            float u0 = 1.0f, v0 = 1.0f, u1 = 0.0f, v1 = 0.0f;
+            for (size_t i = 0; i < roi_areas[k].size(); i++) {
+                const eq::Viewport& vp = roi_areas[k][i];
+                float area[4] = { vp.x, vp.y, vp.w, vp.h };
+                if (init_data.screen == screen_canvas) {
+                    float canvas_area[4] = { vp.x, vp.y, vp.w, vp.h };
+                    canvas_area_to_screen_area(frame_data[0]->canvas, canvas_area, area);
+                } else {
+                    float screen_area[4] = { vp.x, vp.y, vp.w, vp.h };
+                    screen_area_to_desktop_area(frame_data[0]->placement, screen_area, area);
+                }
+                u0 = std::min(u0, area[0]);
+                v0 = std::min(v0, area[1]);
+                u1 = std::max(u1, area[0] + area[2]);
+                v1 = std::max(v1, area[1] + area[3]);
+            }
+            roi_frame_data[k]->region = area_to_rectangle(u0, v0, u1, v1,
+                    frame_data[0]->vnc_width, frame_data[0]->vnc_height);
+        }
+    }
+
+    bool redraw_requested;
+    bool keyframe_requested;
+    // The desktop that receives key events: the one that got the last
+    // pointer event
+    size_t input_desktop;
+
+    // Performance statistics: a CSV log with one line per frame and pipe,
+    // and summaries that are printed every stats_interval seconds and/or
+    // shown in the overlay.
+    FILE* stats_file;
+    float stats_interval;
+    lunchbox::Clock stats_clock;
+    stats_summary_t stats_summary;
+    int stats_vnc_messages;
+    float stats_vnc_decode_time;
+
+    void reset_stats_summary()
+    {
+        stats_summary.frames = 0;
+        stats_summary.vnc_messages = 0;
+        stats_summary.vnc_decode_time = 0.0f;
+        stats_summary.rectangles = 0;
+        stats_summary.bytes = 0;
+        stats_summary.commit_time = 0.0f;
+        stats_summary.max_sync_time = 0.0f;
+        stats_summary.max_upload_time = 0.0f;
+        stats_summary.upload_bytes = 0;
+        stats_summary.slowest_pipe.clear();
+        stats_clock.reset();
+    }
+
+    void record_frame_stats(uint32_t frame_number, float commit_time)
+    {
+        int rectangles = 0;
+        long long bytes = 0;
+        for (size_t i = 0; roi_frame_data.empty() && i < frame_data.size(); i++) {
+            rectangles += frame_data[i]->sent_rectangles;
+            bytes += frame_data[i]->sent_bytes;
+        }
+        for (size_t i = 0; i < roi_frame_data.size(); i++) {
+            rectangles += roi_frame_data[i]->sent_rectangles;
+            bytes += roi_frame_data[i]->sent_bytes;
+        }
+        if (stats_file) {
+            fprintf(stats_file, "%u,app,%d,%.3f,%d,%lld,%.3f,,,\n", frame_number,
+                    stats_vnc_messages, stats_vnc_decode_time, rectangles, bytes, commit_time);
+        }
+        stats_summary.frames++;
+        stats_summary.vnc_messages += stats_vnc_messages;
+        stats_summary.vnc_decode_time += stats_vnc_decode_time;
+        stats_summary.rectangles += rectangles;
+        stats_summary.bytes += bytes;
+        stats_summary.commit_time += commit_time;
+        stats_vnc_messages = 0;
+        stats_vnc_decode_time = 0.0f;
+    }
+
+    void record_pipe_stats(const pipe_stats_t& stats)
+    {
+        std::string name(stats.name, strnlen(stats.name, sizeof(stats.name)));
+        if (stats_file) {
+            fprintf(stats_file, "%u,%s,,,,,,%.3f,%.3f,%u\n", stats.frame_number, name.c_str(),
+                    stats.sync_time, stats.upload_time, stats.upload_bytes);
+        }
+        if (stats.sync_time + stats.upload_time
+                >= stats_summary.max_sync_time + stats_summary.max_upload_time) {
+            stats_summary.max_sync_time = stats.sync_time;
+            stats_summary.max_upload_time = stats.upload_time;
+            stats_summary.slowest_pipe = name;
+        }
+        stats_summary.upload_bytes += stats.upload_bytes;
+    }
+
+    // Finish the summary when its period is over
+    void update_stats_summary()
+    {
+        float seconds = stats_clock.getTimef() / 1000.0f;
+        if (seconds < (stats_interval > 0.0f ? stats_interval : 1.0f))
+            return;
+        const stats_summary_t& s = stats_summary;
+        int frames = std::max(s.frames, 1);
+        char text[256];
+        snprintf(text, sizeof(text), "%.1f fps | VNC %.1f msg/s, decode %.1f ms/frame | "
+                "sent %.1f rect/frame, %.2f MB/s, commit %.1f ms | "
+                "slowest pipe %s: sync %.1f ms, upload %.1f ms | upload %.2f MB/s",
+                s.frames / seconds, s.vnc_messages / seconds, s.vnc_decode_time / frames,
+                s.rectangles / static_cast<float>(frames), s.bytes / seconds / 1e6f, s.commit_time / frames,
+                s.slowest_pipe.empty() ? "-" : s.slowest_pipe.c_str(), s.max_sync_time, s.max_upload_time,
+                s.upload_bytes / seconds / 1e6f);
+        if (stats_interval > 0.0f)
+            fprintf(stderr, "%s\n", text);
+        if (init_data.stats_hud)
+            frame_data[0]->stats_text = text;
+        if (stats_file)
+            fflush(stats_file);
+        reset_stats_summary();
+    }
+
+    // Send a pointer event on the canvas to the desktop under the pointer.
+    // While buttons are held, the events go to the desktop where the drag
+    // started, even if the pointer leaves it.
+    void send_pointer_event(const eq::PointerEvent& e, const eq::RenderContext& context, bool may_switch)
+    {
+        int vnc_x, vnc_y, vnc_buttons;
+        for (size_t i = 0; may_switch && i < frame_data.size(); i++) {
+            if (eqptr_to_rfbptr(e, context.pvp, context.vp, frame_data[i]->canvas,
+                        frame_data[i]->vnc_width, frame_data[i]->vnc_height, vnc_x, vnc_y, vnc_buttons)) {
+                input_desktop = i;
+                break;
+            }
+        }
+        if (input_desktop >= vnc_connections.size())
+            return;
+        const eq_frame_data* fd = frame_data[input_desktop];
+        eqptr_to_rfbptr(e, context.pvp, context.vp, fd->canvas, fd->vnc_width, fd->vnc_height,
+                vnc_x, vnc_y, vnc_buttons);
+        vnc_connections[input_desktop]->send_pointer(vnc_x, vnc_y, vnc_buttons);
+    }
+
 public:
     eq_init_data init_data;
-    eq_frame_data frame_data;
+    // One frame data object per desktop
+    std::vector<eq_frame_data*> frame_data;
+
+    eq_config(eq::ServerPtr parent) : eq::Config(parent), redraw_requested(true), keyframe_requested(false),
+        input_desktop(0), stats_file(NULL), stats_interval(0.0f), stats_vnc_messages(0), stats_vnc_decode_time(0.0f)
+    {
+        reset_stats_summary();
+    }
+
+    // Enable the collection of statistics. The CSV log is written to the
+    // file with the given name, if any; summaries are printed every
+    // interval seconds if interval is positive, and with hud the render nodes
+    // draw them as an overlay. Call this before init().
+    bool init_stats(const char* file_name, float interval, bool hud)
+    {
+        if (file_name) {
+            stats_file = fopen(file_name, "w");
+            if (!stats_file) {
+                fprintf(stderr, "Cannot open %s: %s\n", file_name, std::strerror(errno));
+                return false;
+            }
+            fprintf(stats_file, "frame,source,vnc_messages,vnc_decode_ms,rectangles,bytes,commit_ms,"
+                    "sync_ms,upload_ms,upload_bytes\n");
+        }
+        stats_interval = interval;
+        init_data.stats = (file_name || interval > 0.0f || hud);
+        init_data.stats_hud = hud;
+        return true;
+    }
+
+    // Add VNC statistics for the next frame
+    void add_vnc_stats(int messages, float decode_time)
+    {
+        stats_vnc_messages += messages;
+        stats_vnc_decode_time += decode_time;
+    }
+
+    // Whether the application node has a multicast connection. Collage then
+    // sends the frame data to all render nodes in the same multicast group
+    // at once; other nodes still get it via unicast.
+    bool has_multicast()
+    {
+        const co::ConnectionDescriptions& descriptions = getClient()->getConnectionDescriptions();
+        for (size_t i = 0; i < descriptions.size(); i++) {
+            if (descriptions[i]->type == co::CONNECTIONTYPE_RSP)
+                return true;
+        }
+        return false;
+    }
+
+    // Whether an event requested a redraw since the last frame, or a video
+    // region will need its lossless refresh
+    bool needs_redraw() const
+    {
+        for (size_t i = 0; i < frame_data.size(); i++) {
+            if (frame_data[i]->video_refresh_pending())
+                return true;
+        }
+        return redraw_requested;
+    }
 
-    eq_config(eq::ServerPtr parent) : eq::Config(parent)
+    virtual ~eq_config()
     {
+        for (size_t i = 0; i < roi_frame_data.size(); i++)
+            delete roi_frame_data[i];
+        for (size_t i = 0; i < frame_data.size(); i++)
+            delete frame_data[i];
+        if (stats_file)
+            fclose(stats_file);
     }
 
-    bool init(bool view_only, screen_t screen,
-            const float screen_def[10], const float head_matrix[16])
+    // Initialize the configuration for one desktop per placement (relative
+    // screen areas x,y,w,h with origin top left).
+    bool init(const std::vector<eq::Viewport>& placements, bool view_only, screen_t screen,
+            const float screen_def[10], const float head_matrix[16], bool roi, bool lod,
+            transport_format_t format, bool detect_video, bool has_compressor, uint32_t compressor, bool use_delta)
     {
-        registerObject(&frame_data);
-        init_data.frame_data_id = frame_data.getID();
+        for (size_t i = 0; i < placements.size(); i++) {
+            eq_frame_data* fd = new eq_frame_data;
+            fd->placement[0] = placements[i].x;
+            fd->placement[1] = placements[i].y;
+            fd->placement[2] = placements[i].w;
+            fd->placement[3] = placements[i].h;
+            fd->format = format;
+            fd->detect_video = (detect_video && format != format_yuv420);
+            fd->has_compressor = has_compressor;
+            fd->compressor = compressor;
+            fd->use_delta = use_delta;
+            if (!registerObject(fd)) {
+                delete fd;
+                return false;
+            }
+            frame_data.push_back(fd);
+            init_data.frame_data_ids.push_back(fd->getID());
+        }
         init_data.view_only = view_only;
         init_data.screen = screen;
         if (screen == screen_canvas) {
@@ -320,6 +2834,19 @@ public:
         }
         for (int i = 0; i < 16; i++)
             init_data.head_matrix[i] = head_matrix[i];
+        init_data.lod = lod;
+        if (roi) {
+            if (frame_data.size() != 1) {
+                fprintf(stderr, "Region of interest mode supports only a single desktop\n");
+                return false;
+            }
+            if (getCanvases().size() == 0) {
+                fprintf(stderr, "Region of interest mode requires a canvas in the Equalizer configuration\n");
+                return false;
+            }
+            if (!init_roi())
+                return false;
+        }
         registerObject(&init_data);
         return eq::Config::init(init_data.getID());
     }
@@ -328,206 +2855,1067 @@ public:
     {
         bool ret = eq::Config::exit();
         deregisterObject(&init_data);
-        deregisterObject(&frame_data);
+        for (size_t i = 0; i < roi_frame_data.size(); i++)
+            deregisterObject(roi_frame_data[i]);
+        for (size_t i = 0; i < frame_data.size(); i++)
+            deregisterObject(frame_data[i]);
         return ret;
     }
 
     virtual uint32_t startFrame()
     {
-        if (init_data.screen == screen_canvas) {
-            frame_data.canvas[0] = getCanvases()[0]->getWall().getWidth();
-            frame_data.canvas[1] = getCanvases()[0]->getWall().getHeight();
-            float ar = frame_data.vnc_width / static_cast<float>(frame_data.vnc_height);
-            float canvas_ar = frame_data.canvas[0] / frame_data.canvas[1];
-            if (ar >= canvas_ar) {
-                frame_data.canvas[4] = 1.0f;
-                frame_data.canvas[5] = canvas_ar / ar;
+        for (size_t i = 0; init_data.screen == screen_canvas && i < frame_data.size(); i++) {
+            // Center the desktop in its placement area, keeping its aspect
+            // ratio
+            eq_frame_data* fd = frame_data[i];
+            const float* p = fd->placement;
+            fd->canvas[0] = getCanvases()[0]->getWall().getWidth();
+            fd->canvas[1] = getCanvases()[0]->getWall().getHeight();
+            float ar = fd->vnc_width / static_cast<float>(fd->vnc_height);
+            float area_ar = (p[2] * fd->canvas[0]) / (p[3] * fd->canvas[1]);
+            if (ar >= area_ar) {
+                fd->canvas[4] = p[2];
+                fd->canvas[5] = p[3] * area_ar / ar;
             } else {
-                frame_data.canvas[4] = ar / canvas_ar;
-                frame_data.canvas[5] = 1.0f;
+                fd->canvas[4] = p[2] * ar / area_ar;
+                fd->canvas[5] = p[3];
+            }
+            fd->canvas[2] = p[0] + (p[2] - fd->canvas[4]) / 2.0f;
+            fd->canvas[3] = 1.0f - (p[1] + p[3]) + (p[3] - fd->canvas[5]) / 2.0f;
+        }
+        eq::Matrix4f hm;
+        for (int i = 0; i < 16; i++)
+            hm.array[i] = init_data.head_matrix[i];
+        getObservers().at(0)->setHeadMatrix(hm);
+        update_roi_regions();
+        redraw_requested = false;
+        for (size_t i = 0; i < frame_data.size(); i++)
+            frame_data[i]->keyframe = keyframe_requested;
+        keyframe_requested = false;
+        if (init_data.stats)
+            update_stats_summary();
+        for (size_t i = 0; i < frame_data.size(); i++) {
+            frame_data[i]->classify_video();
+            frame_data[i]->prepare_reference();
+        }
+        lunchbox::Clock commit_clock;
+        const eq::uint128_t version = frame_data[0]->commit();
+        // All frame data objects are committed once per frame, so that their
+        // versions stay in lockstep and pipes can sync them to the frame id.
+        // Desktops without changes only send a small header.
+        for (size_t i = 1; i < frame_data.size(); i++) {
+            if (frame_data[i]->commit() != version)
+                fprintf(stderr, "Frame data versions out of sync\n");
+        }
+        for (size_t i = 0; i < roi_frame_data.size(); i++) {
+            if (roi_frame_data[i]->commit() != version)
+                fprintf(stderr, "Frame data versions out of sync\n");
+        }
+        float commit_time = commit_clock.getTimef();
+        for (size_t i = 0; i < frame_data.size(); i++)
+            frame_data[i]->update_reference();
+        uint32_t frame_number = eq::Config::startFrame(version);
+        if (init_data.stats)
+            record_frame_stats(frame_number, commit_time);
+        return frame_number;
+    }
+
+    virtual bool handleEvent(const eq::ConfigEvent* event)
+    {
+        if (event->data.type == event_keyframe_request) {
+            keyframe_requested = true;
+            redraw_requested = true;
+            return true;
+        }
+        if (event->data.type == event_pipe_stats) {
+            pipe_stats_t stats;
+            std::memcpy(&stats, event->data.user.data, sizeof(stats));
+            record_pipe_stats(stats);
+            return false;
+        }
+        if (eq::Config::handleEvent(event)) {
+            redraw_requested = true;
+            return true;
+        }
+        if (init_data.view_only)
+            return false;
+        if (event->data.type == eq::Event::KEY_PRESS) {
+            if (input_desktop < vnc_connections.size())
+                vnc_connections[input_desktop]->send_key(eqkey_to_rfbkey(event->data.keyPress), true);
+            return true;
+        } else if (event->data.type == eq::Event::KEY_RELEASE) {
+            if (input_desktop < vnc_connections.size())
+                vnc_connections[input_desktop]->send_key(eqkey_to_rfbkey(event->data.keyRelease), false);
+            return true;
+        } else if (init_data.screen == screen_canvas) {
+            if (event->data.type == eq::Event::CHANNEL_POINTER_MOTION) {
+                const eq::PointerEvent& e = event->data.pointerMotion;
+                send_pointer_event(e, event->data.context,
+                        !(e.buttons & (eq::PTR_BUTTON1 | eq::PTR_BUTTON2 | eq::PTR_BUTTON3)));
+            } else if (event->data.type == eq::Event::CHANNEL_POINTER_BUTTON_PRESS) {
+                // Only the first button of a drag selects the desktop
+                const eq::PointerEvent& e = event->data.pointerButtonPress;
+                send_pointer_event(e, event->data.context, e.buttons == e.button);
+            } else if (event->data.type == eq::Event::CHANNEL_POINTER_BUTTON_RELEASE) {
+                send_pointer_event(event->data.pointerButtonRelease, event->data.context, false);
+            } else if (event->data.type ==
+#if EQ_VERSION_GE(1,6,0)
+                    eq::Event::CHANNEL_POINTER_WHEEL
+#else
+                    eq::Event::WINDOW_POINTER_WHEEL
+#endif
+                    ) {
+                send_pointer_event(event->data.pointerWheel, event->data.context, true);
+            }
+        }
+        return false;
+    }
+};
+
+// The frame data is mapped once per render node and shared by its pipes.
+// The node syncs it in frameStart() before releasing the pipes for the
+// frame, and with Equalizer's default DRAW_SYNC thread model (or
+// LOCAL_SYNC), the next frameStart() only happens after all pipes finished
+// drawing. The pipes therefore read the frame data without locking; the
+// ASYNC thread model is not supported.
+class eq_node : public eq::Node
+{
+public:
+    eq_init_data init_data;
+    // One frame data object per desktop
+    std::vector<eq_frame_data*> frame_data;
+    float sync_time;            // ms to sync the frame data of this frame
+
+    eq_node(eq::Config* parent) : eq::Node(parent), sync_time(0.0f)
+    {
+    }
+
+    virtual ~eq_node()
+    {
+        for (size_t i = 0; i < frame_data.size(); i++)
+            delete frame_data[i];
+    }
+
+protected:
+    virtual bool configInit(const eq::uint128_t& init_id)
+    {
+        if (!eq::Node::configInit(init_id)) {
+            return false;
+        }
+        eq_config* config = static_cast<eq_config*>(getConfig());
+        if (!config->mapObject(&init_data, init_id)) {
+            return false;
+        }
+        for (size_t d = 0; d < init_data.frame_data_ids.size(); d++) {
+            eq::uint128_t frame_data_id = init_data.frame_data_ids[d];
+            for (size_t i = 0; i < init_data.roi_node_ids.size(); i++) {
+                if (init_data.roi_node_ids[i] == getID())
+                    frame_data_id = init_data.roi_frame_data_ids[i];
+            }
+            eq_frame_data* fd = new eq_frame_data;
+            frame_data.push_back(fd);
+            if (!config->mapObject(fd, frame_data_id))
+                return false;
+        }
+        // The mapped version only contains the changes of one frame; ask
+        // the application node for the complete framebuffer.
+        eq::ConfigEvent event;
+        event.data.type = event_keyframe_request;
+        config->sendEvent(event);
+        return true;
+    }
+
+    virtual bool configExit()
+    {
+        eq::Config* config = getConfig();
+        for (size_t i = 0; i < frame_data.size(); i++) {
+            if (frame_data[i]->isAttached())
+                config->unmapObject(frame_data[i]);
+            delete frame_data[i];
+        }
+        frame_data.clear();
+        config->unmapObject(&init_data);
+        return eq::Node::configExit();
+    }
+
+    virtual void frameStart(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    {
+        lunchbox::Clock sync_clock;
+        for (size_t i = 0; i < frame_data.size(); i++) {
+            frame_data[i]->vnc_dirty_rectangles.clear();
+            frame_data[i]->vnc_copy_rectangles.clear();
+            frame_data[i]->sync(frame_id);
+            frame_data[i]->record_changes(frame_number);
+        }
+        sync_time = sync_clock.getTimef();
+        eq::Node::frameStart(frame_id, frame_number);
+    }
+};
+
+class eq_pipe : public eq::Pipe
+{
+public:
+    // The statistics of the current frame; the windows add their upload
+    // times
+    pipe_stats_t stats;
+
+    eq_pipe(eq::Node* parent) : eq::Pipe(parent)
+    {
+        std::memset(&stats, 0, sizeof(stats));
+    }
+
+    // The frame data of the node; see eq_node
+    const std::vector<eq_frame_data*>& frame_data() const
+    {
+        return static_cast<const eq_node*>(getNode())->frame_data;
+    }
+
+protected:
+    virtual bool configInit(const eq::uint128_t& init_id)
+    {
+        if (!eq::Pipe::configInit(init_id))
+            return false;
+        std::strncpy(stats.name, getName().empty() ? "pipe" : getName().c_str(), sizeof(stats.name) - 1);
+        return true;
+    }
+
+    virtual void frameStart(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    {
+        // This waits until the node synced the frame data
+        eq::Pipe::frameStart(frame_id, frame_number);
+        stats.frame_number = frame_number;
+        stats.sync_time = static_cast<const eq_node*>(getNode())->sync_time;
+        stats.upload_time = 0.0f;
+        stats.upload_bytes = 0;
+    }
+
+    virtual void frameFinish(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    {
+        if (static_cast<eq_node*>(getNode())->init_data.stats) {
+            eq::ConfigEvent event;
+            event.data.type = event_pipe_stats;
+            std::memcpy(event.data.user.data, &stats, sizeof(stats));
+            getConfig()->sendEvent(event);
+        }
+        eq::Pipe::frameFinish(frame_id, frame_number);
+    }
+};
+
+// Decide which rectangles to upload to the texture: either the dirty
+// rectangles individually, or their bounding rectangle if they cover most of
+// it anyway (or if there are so many of them that the per-call overhead of
+// glTexSubImage2D dominates).
+static void get_upload_rectangles(const std::vector<rectangle_t>& dirty_rectangles,
+        const rectangle_t& clip, std::vector<rectangle_t>& upload_rectangles)
+{
+    upload_rectangles.clear();
+    int bb_x0 = clip.x + clip.w, bb_y0 = clip.y + clip.h, bb_x1 = clip.x, bb_y1 = clip.y;
+    long long area = 0;
+    for (size_t i = 0; i < dirty_rectangles.size(); i++) {
+        // Clip to the part of the framebuffer that the texture holds
+        rectangle_t c;
+        if (!clip_rectangle(dirty_rectangles[i], clip, c))
+            continue;
+        upload_rectangles.push_back(c);
+        area += static_cast<long long>(c.w) * c.h;
+        bb_x0 = std::min(bb_x0, c.x);
+        bb_y0 = std::min(bb_y0, c.y);
+        bb_x1 = std::max(bb_x1, c.x + c.w);
+        bb_y1 = std::max(bb_y1, c.y + c.h);
+    }
+    if (upload_rectangles.size() > 1) {
+        long long bb_area = static_cast<long long>(bb_x1 - bb_x0) * (bb_y1 - bb_y0);
+        if (upload_rectangles.size() > 64 || 2 * area >= bb_area) {
+            rectangle_t bb = { bb_x0, bb_y0, bb_x1 - bb_x0, bb_y1 - bb_y0 };
+            upload_rectangles.clear();
+            upload_rectangles.push_back(bb);
+        }
+    }
+}
+
+// Halve the resolution of w x h 32 bit BGRA pixels with a box filter. For
+// odd sizes, the last row or column is repeated.
+static void halve_pixels(const std::vector<unsigned int>& src, int& w, int& h, std::vector<unsigned int>& dst)
+{
+    const int dw = (w + 1) / 2;
+    const int dh = (h + 1) / 2;
+    dst.resize(dw * dh);
+    for (int y = 0; y < dh; y++) {
+        const unsigned int* row0 = &(src[(2 * y) * w]);
+        const unsigned int* row1 = &(src[std::min(2 * y + 1, h - 1) * w]);
+        for (int x = 0; x < dw; x++) {
+            const int x0 = 2 * x;
+            const int x1 = std::min(2 * x + 1, w - 1);
+            unsigned int p = 0;
+            for (int c = 0; c < 32; c += 8) {
+                unsigned int sum = ((row0[x0] >> c) & 0xff) + ((row0[x1] >> c) & 0xff)
+                    + ((row1[x0] >> c) & 0xff) + ((row1[x1] >> c) & 0xff);
+                p |= ((sum + 2) / 4) << c;
+            }
+            dst[y * dw + x] = p;
+        }
+    }
+    w = dw;
+    h = dh;
+}
+
+// The desktop is held in fixed-size texture tiles, so that desktops larger
+// than GL_MAX_TEXTURE_SIZE work, and so that only the tiles that are visible
+// need to exist and be updated.
+typedef struct {
+    GLuint tex;         // 0 if the tile is not visible
+    rectangle_t r;      // the part of the desktop shown by this tile
+    rectangle_t tex_r;  // the part of the desktop held in tex: r plus a
+                        // border for seamless filtering
+    int tex_w, tex_h;   // the size of tex at mipmap level 0
+} tile_t;
+
+// The textures of one desktop in a window
+typedef struct {
+    int tiles_desktop_w, tiles_desktop_h; // desktop size for which the tiles were made
+    std::vector<tile_t> tiles;
+    // The relative desktop areas visible in the channels that use the
+    // tiles, as reported by these channels in their last frameDraw()
+    std::vector<const eq::Channel*> visible_area_channels;
+    std::vector<eq::Viewport> visible_areas;
+    // The number of desktop pixels per channel pixel in these channels
+    std::vector<float> densities;
+    // The tiles hold the desktop at 1/2^lod of its resolution, with the given
+    // number of mipmap levels. Both are chosen from the densities.
+    int lod;
+    int levels;
+    // The cursor overlay
+    GLuint cursor_tex;
+    int cursor_tex_version;     // frame data cursor_version of cursor_tex
+} desktop_textures_t;
+
+// The screen geometry is drawn from a vertex buffer that holds a triangle
+// strip with mesh_segments segments. Each vertex is given as its segment
+// index and 0 or 1 for the top or bottom edge; the vertex shader maps these
+// to the relative desktop area of a tile and then to the screen. The
+// segment count can thus be chosen per draw call without rebuilding the
+// mesh.
+static const int mesh_segments = 1024;
+
+static const char* mesh_vertex_shader =
+    "#version 120\n"
+    "uniform mat4 mvp;\n"
+    "uniform mat4 model;           // planar screen or cylinder coordinates to world\n"
+    "uniform bool cylinder;\n"
+    "uniform vec4 cylinder_params; // radius, phi_center, phi_range, half height\n"
+    "uniform vec4 placement;       // relative screen area x, y, w, h of the desktop\n"
+    "uniform vec4 area;            // relative desktop area s0, t0, s1, t1\n"
+    "uniform float segments;\n"
+    "uniform vec4 tex_map;         // relative desktop to tile texture coordinates\n"
+    "attribute vec2 vertex;\n"
+    "varying vec2 texcoord;\n"
+    "void main()\n"
+    "{\n"
+    "    float s = mix(area.x, area.z, min(vertex.x / segments, 1.0));\n"
+    "    float t = mix(area.y, area.w, vertex.y);\n"
+    "    vec2 q = placement.xy + vec2(s, t) * placement.zw;\n"
+    "    vec4 p = vec4(q, 0.0, 1.0);\n"
+    "    if (cylinder) {\n"
+    "        float phi = cylinder_params.y + (q.x - 0.5) * cylinder_params.z;\n"
+    "        p = vec4(cylinder_params.x * cos(phi), cylinder_params.w * (1.0 - 2.0 * q.y),\n"
+    "                cylinder_params.x * sin(phi), 1.0);\n"
+    "    }\n"
+    "    gl_Position = mvp * (model * p);\n"
+    "    texcoord = vec2(s * tex_map.x + tex_map.y, t * tex_map.z + tex_map.w);\n"
+    "}\n";
+
+static const char* mesh_fragment_shader =
+    "#version 120\n"
+    "uniform sampler2D tex;\n"
+    "varying vec2 texcoord;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = texture2D(tex, texcoord);\n"
+    "}\n";
+
+class eq_window : public eq::Window
+{
+public:
+    // All windows that share the OpenGL context of another window use the
+    // tiles and buffers of that window; see texture_window().
+    int tile_size;
+    std::vector<desktop_textures_t> desktops;
+    uint32_t tex_frame_number;  // frame for which the tiles were last updated
+    GLuint pbo[2];              // double-buffered pixel buffer objects for streaming
+    GLsizeiptr pbo_size[2];
+    int pbo_index;
+    GLuint copy_tex;            // temporary texture for copy operations
+    int copy_tex_w, copy_tex_h;
+    std::vector<rectangle_t> dirty_rectangles;
+    std::vector<rectangle_t> upload_rectangles;
+    std::vector<size_t> upload_tiles; // the tile of each upload rectangle
+    // The screen mesh and its shader program
+    GLuint mesh_vbo;
+    GLuint mesh_prg;
+    GLint mesh_mvp_loc, mesh_model_loc, mesh_cylinder_loc, mesh_cylinder_params_loc;
+    GLint mesh_placement_loc, mesh_area_loc, mesh_segments_loc, mesh_tex_map_loc, mesh_tex_loc;
+
+    // Return the window that owns the tiles used by this window.
+    eq_window* texture_window()
+    {
+        const eq::Window* shared = getSharedContextWindow();
+        if (!shared || shared == this)
+            return this;
+        return const_cast<eq_window*>(static_cast<const eq_window*>(shared));
+    }
+
+    const eq_window* texture_window() const
+    {
+        return const_cast<eq_window*>(this)->texture_window();
+    }
+
+    eq_window(eq::Pipe* parent) : eq::Window(parent),
+        tile_size(1024), tex_frame_number(0),
+        pbo_index(0), copy_tex(0), copy_tex_w(0), copy_tex_h(0), mesh_vbo(0), mesh_prg(0)
+    {
+        pbo[0] = pbo[1] = 0;
+        pbo_size[0] = pbo_size[1] = 0;
+    }
+
+    // Get the textures of the given desktop, creating them when needed
+    desktop_textures_t& desktop_textures(size_t desktop)
+    {
+        while (desktops.size() <= desktop) {
+            desktop_textures_t d;
+            d.tiles_desktop_w = d.tiles_desktop_h = 0;
+            d.lod = 0;
+            d.levels = 1;
+            d.cursor_tex = 0;
+            d.cursor_tex_version = 0;
+            desktops.push_back(d);
+        }
+        return desktops[desktop];
+    }
+
+    void set_visible_area(size_t desktop, const eq::Channel* channel, const eq::Viewport& area, float density)
+    {
+        desktop_textures_t& d = desktop_textures(desktop);
+        for (size_t i = 0; i < d.visible_area_channels.size(); i++) {
+            if (d.visible_area_channels[i] == channel) {
+                d.visible_areas[i] = area;
+                d.densities[i] = density;
+                return;
             }
-            frame_data.canvas[2] = (1.0f - frame_data.canvas[4]) / 2.0f;
-            frame_data.canvas[3] = (1.0f - frame_data.canvas[5]) / 2.0f;
         }
-        eq::Matrix4f hm;
-        for (int i = 0; i < 16; i++)
-            hm.array[i] = init_data.head_matrix[i];
-        getObservers().at(0)->setHeadMatrix(hm);
-        const eq::uint128_t version = frame_data.commit();
-        return eq::Config::startFrame(version);
+        d.visible_area_channels.push_back(channel);
+        d.visible_areas.push_back(area);
+        d.densities.push_back(density);
+    }
+
+    // Choose the texture resolution of a desktop: the channel with the
+    // highest pixel density still gets at least one texel per pixel, and
+    // mipmap levels are added down to the density of the channel with the
+    // lowest one.
+    void choose_lod(const desktop_textures_t& d, int& lod, int& levels) const
+    {
+        lod = 0;
+        levels = 1;
+        float min_density = 0.0f, max_density = 0.0f;
+        for (size_t i = 0; i < d.visible_areas.size(); i++) {
+            if (d.visible_areas[i].w <= 0.0f || d.visible_areas[i].h <= 0.0f)
+                continue;
+            if (max_density <= 0.0f || d.densities[i] < min_density)
+                min_density = d.densities[i];
+            max_density = std::max(max_density, d.densities[i]);
+        }
+        if (!static_cast<const eq_node*>(getPipe()->getNode())->init_data.lod || max_density <= 0.0f)
+            return;
+        lod = std::min(std::max(static_cast<int>(std::floor(std::log(min_density) / std::log(2.0f))), 0), 4);
+        int max_lod = static_cast<int>(std::floor(std::log(max_density) / std::log(2.0f)));
+        levels = std::min(std::max(max_lod - lod + 1, 1), 5);
+    }
+
+    // Get the part of the desktop that the channels using the tiles show.
+    // This fails as long as not all of these channels have reported their
+    // area.
+    bool get_visible_region(const desktop_textures_t& d, int width, int height, rectangle_t& region) const
+    {
+        const std::vector<eq::Viewport>& visible_areas = d.visible_areas;
+        size_t channels = 0;
+        const eq::Windows& windows = getPipe()->getWindows();
+        for (size_t i = 0; i < windows.size(); i++) {
+            if (static_cast<const eq_window*>(windows[i])->texture_window() == this)
+                channels += windows[i]->getChannels().size();
+        }
+        if (visible_areas.size() < channels)
+            return false;
+        float u0 = 1.0f, v0 = 1.0f, u1 = 0.0f, v1 = 0.0f;
+        for (size_t i = 0; i < visible_areas.size(); i++) {
+            const eq::Viewport& a = visible_areas[i];
+            if (a.w <= 0.0f || a.h <= 0.0f)
+                continue;
+            u0 = std::min(u0, a.x);
+            v0 = std::min(v0, a.y);
+            u1 = std::max(u1, a.x + a.w);
+            v1 = std::max(v1, a.y + a.h);
+        }
+        region = area_to_rectangle(u0, v0, u1, v1, width, height);
+        return true;
+    }
+
+protected:
+    void delete_tiles(desktop_textures_t& d)
+    {
+        for (size_t i = 0; i < d.tiles.size(); i++) {
+            if (d.tiles[i].tex != 0)
+                glDeleteTextures(1, &(d.tiles[i].tex));
+        }
+        d.tiles.clear();
     }
 
-    virtual bool handleEvent(const eq::ConfigEvent* event)
+    void create_tiles(desktop_textures_t& d, int width, int height, int lod, int levels)
     {
-        if (eq::Config::handleEvent(event))
-            return true;
-        if (init_data.view_only)
-            return false;
-        if (!vnc_client)
-            return false;
-        if (event->data.type == eq::Event::KEY_PRESS) {
-            SendKeyEvent(vnc_client, eqkey_to_rfbkey(event->data.keyPress), TRUE);
-            return true;
-        } else if (event->data.type == eq::Event::KEY_RELEASE) {
-            SendKeyEvent(vnc_client, eqkey_to_rfbkey(event->data.keyRelease), FALSE);
-            return true;
-        } else if (init_data.screen == screen_canvas) {
-            if (event->data.type == eq::Event::CHANNEL_POINTER_MOTION) {
-                int vnc_x, vnc_y, vnc_buttons;
-                eqptr_to_rfbptr(event->data.pointerMotion, event->data.context.pvp, event->data.context.vp,
-                        frame_data.canvas, frame_data.vnc_width, frame_data.vnc_height,
-                        vnc_x, vnc_y, vnc_buttons);
-                SendPointerEvent(vnc_client, vnc_x, vnc_y, vnc_buttons);
-            } else if (event->data.type == eq::Event::CHANNEL_POINTER_BUTTON_PRESS) {
-                int vnc_x, vnc_y, vnc_buttons;
-                eqptr_to_rfbptr(event->data.pointerButtonPress, event->data.context.pvp, event->data.context.vp,
-                        frame_data.canvas, frame_data.vnc_width, frame_data.vnc_height,
-                        vnc_x, vnc_y, vnc_buttons);
-                SendPointerEvent(vnc_client, vnc_x, vnc_y, vnc_buttons);
-            } else if (event->data.type == eq::Event::CHANNEL_POINTER_BUTTON_RELEASE) {
-                int vnc_x, vnc_y, vnc_buttons;
-                eqptr_to_rfbptr(event->data.pointerButtonRelease, event->data.context.pvp, event->data.context.vp,
-                        frame_data.canvas, frame_data.vnc_width, frame_data.vnc_height,
-                        vnc_x, vnc_y, vnc_buttons);
-                SendPointerEvent(vnc_client, vnc_x, vnc_y, vnc_buttons);
-            } else if (event->data.type ==
-#if EQ_VERSION_GE(1,6,0)
-                    eq::Event::CHANNEL_POINTER_WHEEL
-#else
-                    eq::Event::WINDOW_POINTER_WHEEL
-#endif
-                    ) {
-                int vnc_x, vnc_y, vnc_buttons;
-                eqptr_to_rfbptr(event->data.pointerWheel, event->data.context.pvp, event->data.context.vp,
-                        frame_data.canvas, frame_data.vnc_width, frame_data.vnc_height,
-                        vnc_x, vnc_y, vnc_buttons);
-                SendPointerEvent(vnc_client, vnc_x, vnc_y, vnc_buttons);
+        delete_tiles(d);
+        // The border covers one texel of the coarsest mipmap level, and
+        // uploads are aligned to such texels
+        const int border = 1 << (lod + levels - 1);
+        GLint max_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        tile_size = std::min(1024, static_cast<int>(max_size) - 2 * border);
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                tile_t t;
+                t.tex = 0;
+                t.r.x = x;
+                t.r.y = y;
+                t.r.w = std::min(tile_size, width - x);
+                t.r.h = std::min(tile_size, height - y);
+                t.tex_r.x = std::max(x - border, 0);
+                t.tex_r.y = std::max(y - border, 0);
+                t.tex_r.w = std::min(x + t.r.w + border, width) - t.tex_r.x;
+                t.tex_r.h = std::min(y + t.r.h + border, height) - t.tex_r.y;
+                t.tex_w = (t.tex_r.w + (1 << lod) - 1) >> lod;
+                t.tex_h = (t.tex_r.h + (1 << lod) - 1) >> lod;
+                d.tiles.push_back(t);
             }
         }
-        return false;
+        d.tiles_desktop_w = width;
+        d.tiles_desktop_h = height;
+        d.lod = lod;
+        d.levels = levels;
     }
-};
-
-class eq_node : public eq::Node
-{
-public:
-    eq_init_data init_data;
 
-    eq_node(eq::Config* parent) : eq::Node(parent)
+    GLuint compile_shader(GLenum type, const char* src)
     {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &src, NULL);
+        glCompileShader(shader);
+        GLint status;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (status != GL_TRUE) {
+            char log[1024];
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            fprintf(stderr, "Cannot compile shader: %s\n", log);
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
     }
 
-protected:
-    virtual bool configInit(const eq::uint128_t& init_id)
+    bool init_mesh()
     {
-        if (!eq::Node::configInit(init_id)) {
+        if (!GLEW_VERSION_2_0) {
+            fprintf(stderr, "OpenGL 2.0 is not available\n");
             return false;
         }
-        eq_config* config = static_cast<eq_config*>(getConfig());
-        if (!config->mapObject(&init_data, init_id)) {
+        GLuint vs = compile_shader(GL_VERTEX_SHADER, mesh_vertex_shader);
+        GLuint fs = compile_shader(GL_FRAGMENT_SHADER, mesh_fragment_shader);
+        if (vs == 0 || fs == 0) {
+            glDeleteShader(vs);
+            glDeleteShader(fs);
+            return false;
+        }
+        mesh_prg = glCreateProgram();
+        glAttachShader(mesh_prg, vs);
+        glAttachShader(mesh_prg, fs);
+        glBindAttribLocation(mesh_prg, 0, "vertex");
+        glLinkProgram(mesh_prg);
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        GLint status;
+        glGetProgramiv(mesh_prg, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            char log[1024];
+            glGetProgramInfoLog(mesh_prg, sizeof(log), NULL, log);
+            fprintf(stderr, "Cannot link shader program: %s\n", log);
             return false;
         }
+        mesh_mvp_loc = glGetUniformLocation(mesh_prg, "mvp");
+        mesh_model_loc = glGetUniformLocation(mesh_prg, "model");
+        mesh_cylinder_loc = glGetUniformLocation(mesh_prg, "cylinder");
+        mesh_cylinder_params_loc = glGetUniformLocation(mesh_prg, "cylinder_params");
+        mesh_placement_loc = glGetUniformLocation(mesh_prg, "placement");
+        mesh_area_loc = glGetUniformLocation(mesh_prg, "area");
+        mesh_segments_loc = glGetUniformLocation(mesh_prg, "segments");
+        mesh_tex_map_loc = glGetUniformLocation(mesh_prg, "tex_map");
+        mesh_tex_loc = glGetUniformLocation(mesh_prg, "tex");
+        std::vector<float> vertices;
+        for (int i = 0; i <= mesh_segments; i++) {
+            vertices.push_back(i);
+            vertices.push_back(0.0f);
+            vertices.push_back(i);
+            vertices.push_back(1.0f);
+        }
+        glGenBuffers(1, &mesh_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &(vertices[0]), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
         return true;
     }
 
-    virtual bool configExit()
+    virtual bool configInitGL(const eq::uint128_t& init_id)
     {
-        eq::Config* config = getConfig();
-        config->unmapObject(&init_data);
-        return eq::Node::configExit();
+        if (!eq::Window::configInitGL(init_id))
+            return false;
+        // Windows that share a context also share the mesh
+        if (texture_window() != this)
+            return true;
+        return init_mesh();
     }
-};
 
-class eq_pipe : public eq::Pipe
-{
-public:
-    eq_frame_data frame_data;
+    virtual bool configExitGL()
+    {
+        for (size_t i = 0; i < desktops.size(); i++) {
+            delete_tiles(desktops[i]);
+            if (desktops[i].cursor_tex != 0)
+                glDeleteTextures(1, &(desktops[i].cursor_tex));
+        }
+        desktops.clear();
+        if (mesh_vbo != 0)
+            glDeleteBuffers(1, &mesh_vbo);
+        mesh_vbo = 0;
+        if (mesh_prg != 0)
+            glDeleteProgram(mesh_prg);
+        mesh_prg = 0;
+        if (copy_tex != 0)
+            glDeleteTextures(1, &copy_tex);
+        copy_tex = 0;
+        if (pbo[0] != 0)
+            glDeleteBuffers(2, pbo);
+        pbo[0] = pbo[1] = 0;
+        return eq::Window::configExitGL();
+    }
 
-    eq_pipe(eq::Node* parent) : eq::Pipe(parent)
+    // Execute the copy operations of this frame on the tiles. Each copy is
+    // split at the tile borders of its destination; a part is copied on the
+    // GPU if its source lies within one existing tile. Source and
+    // destination may overlap, so copy via a temporary texture. Parts that
+    // cannot be copied (e.g. without ARB_copy_image) are uploaded from the
+    // framebuffer instead.
+    void copy_on_gpu(desktop_textures_t& desktop, const eq_frame_data& frame_data)
     {
+        std::vector<tile_t>& tiles = desktop.tiles;
+        // With reduced resolution or mipmaps, the copies do not map to whole
+        // texels
+        const bool can_copy = (GLEW_ARB_copy_image && desktop.lod == 0 && desktop.levels == 1);
+        GLint max_size = 0;
+        if (can_copy && !frame_data.vnc_copy_rectangles.empty())
+            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        // A copy is split at the tile borders. Its source pieces may overlap
+        // its destination pieces in other tiles, so all source pieces are
+        // gathered in copy_tex (at their position within the copy) before
+        // any destination piece is written.
+        std::vector<size_t> piece_dst, piece_src;
+        std::vector<rectangle_t> pieces;
+        for (size_t i = 0; i < frame_data.vnc_copy_rectangles.size(); i++) {
+            const copy_rectangle_t& c = frame_data.vnc_copy_rectangles[i];
+            rectangle_t dst = { c.x, c.y, c.w, c.h };
+            const bool can_stage = (can_copy && c.w <= max_size && c.h <= max_size);
+            piece_dst.clear();
+            piece_src.clear();
+            pieces.clear();
+            for (size_t d = 0; d < tiles.size(); d++) {
+                rectangle_t r;
+                if (tiles[d].tex == 0 || !clip_rectangle(dst, tiles[d].tex_r, r))
+                    continue;
+                rectangle_t src = { c.src_x + r.x - c.x, c.src_y + r.y - c.y, r.w, r.h };
+                size_t s = 0;
+                for (; can_stage && s < tiles.size(); s++) {
+                    rectangle_t tmp;
+                    if (tiles[s].tex != 0 && clip_rectangle(src, tiles[s].tex_r, tmp)
+                            && tmp.w == src.w && tmp.h == src.h)
+                        break;
+                }
+                if (!can_stage || s == tiles.size()) {
+                    dirty_rectangles.push_back(r);
+                    continue;
+                }
+                piece_dst.push_back(d);
+                piece_src.push_back(s);
+                pieces.push_back(r);
+            }
+            if (pieces.empty())
+                continue;
+            if (copy_tex == 0 || copy_tex_w < c.w || copy_tex_h < c.h) {
+                if (copy_tex == 0)
+                    glGenTextures(1, &copy_tex);
+                copy_tex_w = std::max(copy_tex_w, c.w);
+                copy_tex_h = std::max(copy_tex_h, c.h);
+                glBindTexture(GL_TEXTURE_2D, copy_tex);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, copy_tex_w, copy_tex_h, 0,
+                        GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+            }
+            for (size_t k = 0; k < pieces.size(); k++) {
+                const rectangle_t& r = pieces[k];
+                const tile_t& t = tiles[piece_src[k]];
+                glCopyImageSubData(t.tex, GL_TEXTURE_2D, 0,
+                        c.src_x + r.x - c.x - t.tex_r.x, c.src_y + r.y - c.y - t.tex_r.y, 0,
+                        copy_tex, GL_TEXTURE_2D, 0, r.x - c.x, r.y - c.y, 0, r.w, r.h, 1);
+            }
+            for (size_t k = 0; k < pieces.size(); k++) {
+                const rectangle_t& r = pieces[k];
+                const tile_t& t = tiles[piece_dst[k]];
+                glCopyImageSubData(copy_tex, GL_TEXTURE_2D, 0, r.x - c.x, r.y - c.y, 0,
+                        t.tex, GL_TEXTURE_2D, 0,
+                        r.x - t.tex_r.x, r.y - t.tex_r.y, 0, r.w, r.h, 1);
+            }
+        }
     }
 
-protected:
-    virtual bool configInit(const eq::uint128_t& init_id)
+    // Upload the given rectangles directly from the framebuffer.
+    void upload_direct(const desktop_textures_t& desktop, const eq_frame_data& frame_data)
     {
-        if (!eq::Pipe::configInit(init_id))
-            return false;
-        eq_config* config = static_cast<eq_config*>(getConfig());
-        eq_node* node = static_cast<eq_node*>(getNode());
-        if (!config->mapObject(&frame_data, node->init_data.frame_data_id))
+        const std::vector<tile_t>& tiles = desktop.tiles;
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, frame_data.vnc_width);
+        for (size_t i = 0; i < upload_rectangles.size(); i++) {
+            const rectangle_t& r = upload_rectangles[i];
+            const tile_t& t = tiles[upload_tiles[i]];
+            glBindTexture(GL_TEXTURE_2D, t.tex);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, r.x);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, r.y);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x - t.tex_r.x, r.y - t.tex_r.y, r.w, r.h,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, &(frame_data.vnc_framebuffer[0]));
+        }
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
+    // Pack the given rectangles tightly into a pixel buffer object and upload
+    // them from there, so that the transfer to the GPU can happen
+    // asynchronously. Two buffers are used alternately so that we never wait
+    // for the transfer of the previous frame to finish.
+    bool upload_pbo(const desktop_textures_t& desktop, const eq_frame_data& frame_data)
+    {
+        const std::vector<tile_t>& tiles = desktop.tiles;
+        GLsizeiptr size = 0;
+        for (size_t i = 0; i < upload_rectangles.size(); i++)
+            size += static_cast<GLsizeiptr>(upload_rectangles[i].w) * upload_rectangles[i].h * sizeof(unsigned int);
+        if (pbo[0] == 0)
+            glGenBuffers(2, pbo);
+        pbo_index = (pbo_index + 1) % 2;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[pbo_index]);
+        // Orphan the old buffer storage so that mapping does not stall
+        pbo_size[pbo_index] = std::max(pbo_size[pbo_index], size);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, pbo_size[pbo_index], NULL, GL_STREAM_DRAW);
+        unsigned int* ptr = static_cast<unsigned int*>(glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+        if (!ptr) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
             return false;
+        }
+        size_t offset = 0;
+        for (size_t i = 0; i < upload_rectangles.size(); i++) {
+            const rectangle_t& r = upload_rectangles[i];
+            for (int y = r.y; y < r.y + r.h; y++) {
+                std::memcpy(ptr + offset, &(frame_data.vnc_framebuffer[y * frame_data.vnc_width + r.x]),
+                        r.w * sizeof(unsigned int));
+                offset += r.w;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        offset = 0;
+        for (size_t i = 0; i < upload_rectangles.size(); i++) {
+            const rectangle_t& r = upload_rectangles[i];
+            const tile_t& t = tiles[upload_tiles[i]];
+            glBindTexture(GL_TEXTURE_2D, t.tex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x - t.tex_r.x, r.y - t.tex_r.y, r.w, r.h,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                    reinterpret_cast<const GLvoid*>(offset * sizeof(unsigned int)));
+            offset += static_cast<size_t>(r.w) * r.h;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
         return true;
     }
 
-    virtual bool configExit()
+    // Upload the given rectangles at reduced resolution and/or with
+    // mipmaps. Each rectangle is extended to whole texels of the coarsest
+    // level, and each level is computed from the previous one, so that
+    // mipmaps are only rebuilt where the desktop changed.
+    void upload_scaled(const desktop_textures_t& desktop, const eq_frame_data& frame_data)
     {
-        eq::Config* config = getConfig();
-        config->unmapObject(&frame_data);
-        return eq::Pipe::configExit();
+        const std::vector<tile_t>& tiles = desktop.tiles;
+        const int block = 1 << (desktop.lod + desktop.levels - 1);
+        std::vector<unsigned int> pixels, tmp;
+        for (size_t i = 0; i < upload_rectangles.size(); i++) {
+            const rectangle_t& r = upload_rectangles[i];
+            const tile_t& t = tiles[upload_tiles[i]];
+            const int x0 = (r.x - t.tex_r.x) / block * block;
+            const int y0 = (r.y - t.tex_r.y) / block * block;
+            const int x1 = std::min((r.x + r.w - t.tex_r.x + block - 1) / block * block, t.tex_r.w);
+            const int y1 = std::min((r.y + r.h - t.tex_r.y + block - 1) / block * block, t.tex_r.h);
+            int w = x1 - x0;
+            int h = y1 - y0;
+            pixels.resize(w * h);
+            for (int y = 0; y < h; y++)
+                std::memcpy(&(pixels[y * w]),
+                        &(frame_data.vnc_framebuffer[(t.tex_r.y + y0 + y) * frame_data.vnc_width + t.tex_r.x + x0]),
+                        w * sizeof(unsigned int));
+            for (int l = 0; l < desktop.lod; l++) {
+                halve_pixels(pixels, w, h, tmp);
+                pixels.swap(tmp);
+            }
+            glBindTexture(GL_TEXTURE_2D, t.tex);
+            for (int l = 0; l < desktop.levels; l++) {
+                if (l > 0) {
+                    halve_pixels(pixels, w, h, tmp);
+                    pixels.swap(tmp);
+                }
+                const int shift = desktop.lod + l;
+                glTexSubImage2D(GL_TEXTURE_2D, l, x0 >> shift, y0 >> shift, w, h,
+                        GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, &(pixels[0]));
+            }
+        }
     }
 
-    virtual void frameStart(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    // Bring the tiles of one desktop up to date with its frame data. If
+    // changes is given, the changes of the frame are not enough and the
+    // given rectangles are uploaded instead. Returns the number of pixels
+    // uploaded.
+    long long update_desktop_tiles(desktop_textures_t& desktop, const eq_frame_data& frame_data,
+            const std::vector<rectangle_t>* changes)
     {
-        frame_data.sync(frame_id);
-        eq::Pipe::frameStart(frame_id, frame_number);
+        std::vector<tile_t>& tiles = desktop.tiles;
+        int lod, levels;
+        choose_lod(desktop, lod, levels);
+        if (desktop.tiles_desktop_w != frame_data.vnc_width || desktop.tiles_desktop_h != frame_data.vnc_height
+                || desktop.lod != lod || desktop.levels != levels)
+            create_tiles(desktop, frame_data.vnc_width, frame_data.vnc_height, lod, levels);
+        // Only the tiles that show a visible part of the desktop have a
+        // texture. Release the others, and apply this frame's copies before
+        // creating the textures of newly visible tiles.
+        rectangle_t region = { 0, 0, frame_data.vnc_width, frame_data.vnc_height };
+        get_visible_region(desktop, frame_data.vnc_width, frame_data.vnc_height, region);
+        rectangle_t tmp;
+        for (size_t i = 0; i < tiles.size(); i++) {
+            if (tiles[i].tex != 0 && !clip_rectangle(tiles[i].tex_r, region, tmp)) {
+                glDeleteTextures(1, &(tiles[i].tex));
+                tiles[i].tex = 0;
+            }
+        }
+        if (changes) {
+            dirty_rectangles = *changes;
+        } else {
+            dirty_rectangles = frame_data.vnc_dirty_rectangles;
+            copy_on_gpu(desktop, frame_data);
+        }
+        upload_rectangles.clear();
+        upload_tiles.clear();
+        std::vector<rectangle_t> tile_upload_rectangles;
+        for (size_t i = 0; i < tiles.size(); i++) {
+            tile_t& t = tiles[i];
+            if (t.tex == 0) {
+                if (!clip_rectangle(t.tex_r, region, tmp))
+                    continue;
+                glGenTextures(1, &(t.tex));
+                glBindTexture(GL_TEXTURE_2D, t.tex);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        desktop.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, desktop.levels - 1);
+                for (int l = 0; l < desktop.levels; l++) {
+                    glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA,
+                            std::max((t.tex_w + (1 << l) - 1) >> l, 1), std::max((t.tex_h + (1 << l) - 1) >> l, 1), 0,
+                            GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+                }
+                tile_upload_rectangles.assign(1, t.tex_r);
+            } else {
+                get_upload_rectangles(dirty_rectangles, t.tex_r, tile_upload_rectangles);
+            }
+            upload_rectangles.insert(upload_rectangles.end(),
+                    tile_upload_rectangles.begin(), tile_upload_rectangles.end());
+            upload_tiles.insert(upload_tiles.end(), tile_upload_rectangles.size(), i);
+        }
+        long long pixels = 0;
+        for (size_t i = 0; i < upload_rectangles.size(); i++)
+            pixels += static_cast<long long>(upload_rectangles[i].w) * upload_rectangles[i].h;
+        if (!upload_rectangles.empty()) {
+            if (desktop.lod > 0 || desktop.levels > 1)
+                upload_scaled(desktop, frame_data);
+            else if (!GLEW_ARB_pixel_buffer_object || !upload_pbo(desktop, frame_data))
+                upload_direct(desktop, frame_data);
+        }
+        return pixels;
     }
-};
 
-class eq_window : public eq::Window
-{
-public:
-    GLuint tex;
-    int tex_w, tex_h;
-    bool tex_updated;
-
-    eq_window(eq::Pipe* parent) : eq::Window(parent),
-        tex(0), tex_updated(false)
+    // Bring the tiles of all desktops up to date with the frame data. This
+    // happens only once per frame, no matter how many windows share the
+    // tiles; the current context may be the one of any of these windows.
+    // Returns the number of pixels uploaded.
+    long long update_tiles(const std::vector<eq_frame_data*>& frame_data, uint32_t frame_number)
     {
+        if (tex_frame_number == frame_number)
+            return 0;
+        // The frame data of the node only holds the changes of the current
+        // frame; if this window missed frames (e.g. while its pipe was
+        // inactive), it needs the changes since its last frame from the
+        // history, or everything if that is too old.
+        bool missed = (tex_frame_number != 0 && tex_frame_number + 1 != frame_number);
+        uint32_t last_frame_number = tex_frame_number;
+        tex_frame_number = frame_number;
+        long long pixels = 0;
+        std::vector<rectangle_t> changes;
+        for (size_t i = 0; i < frame_data.size(); i++) {
+            desktop_textures_t& desktop = desktop_textures(i);
+            if (missed && !frame_data[i]->changes_since(last_frame_number, changes)) {
+                rectangle_t full = { 0, 0, frame_data[i]->vnc_width, frame_data[i]->vnc_height };
+                changes.assign(1, full);
+            }
+            pixels += update_desktop_tiles(desktop, *frame_data[i], missed ? &changes : NULL);
+            update_cursor(desktop, *frame_data[i]);
+        }
+        return pixels;
     }
 
-protected:
-    virtual void frameStart(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    void update_cursor(desktop_textures_t& desktop, const eq_frame_data& frame_data)
     {
-        const eq_pipe* pipe = static_cast<eq_pipe*>(getPipe());
-        const eq_frame_data& frame_data = pipe->frame_data;
-        if (tex == 0 || tex_w != frame_data.vnc_width || tex_h != frame_data.vnc_height) {
-            if (tex == 0)
-                glGenTextures(1, &tex);
-            glBindTexture(GL_TEXTURE_2D, tex);
+        const cursor_t& cursor = frame_data.cursor;
+        GLuint& cursor_tex = desktop.cursor_tex;
+        if (desktop.cursor_tex_version == frame_data.cursor_version)
+            return;
+        desktop.cursor_tex_version = frame_data.cursor_version;
+        if (cursor.w <= 0 || cursor.h <= 0)
+            return;
+        if (cursor_tex == 0) {
+            glGenTextures(1, &cursor_tex);
+            glBindTexture(GL_TEXTURE_2D, cursor_tex);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame_data.vnc_width, frame_data.vnc_height, 0,
-                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
-            tex_w = frame_data.vnc_width;
-            tex_h = frame_data.vnc_height;
-            tex_updated = false;
-        }
-        glBindTexture(GL_TEXTURE_2D, tex);
-        if (!tex_updated) {
-            // TODO: optimize this. Use a PBO, and upload only the bounding rectangle
-            // of all dirty rectangles to the texture. Or upload all dirty rectangles
-            // individually? Not sure which is faster in typical scenarios.
-            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame_data.vnc_width, frame_data.vnc_height,
-                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, &(frame_data.vnc_framebuffer[0]));
-            tex_updated = true;
+        } else {
+            glBindTexture(GL_TEXTURE_2D, cursor_tex);
         }
-        eq::Window::frameStart(frame_id, frame_number);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cursor.w, cursor.h, 0,
+                GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, &(cursor.pixels[0]));
     }
 
-    virtual void frameFinish(const eq::uint128_t& frame_id, const uint32_t frame_number)
+    virtual void frameStart(const eq::uint128_t& frame_id, const uint32_t frame_number)
     {
-        tex_updated = false;
-        eq::Window::frameFinish(frame_id, frame_number);
+        eq_pipe* pipe = static_cast<eq_pipe*>(getPipe());
+        lunchbox::Clock upload_clock;
+        long long pixels = texture_window()->update_tiles(pipe->frame_data(), frame_number);
+        pipe->stats.upload_time += upload_clock.getTimef();
+        pipe->stats.upload_bytes += pixels * sizeof(unsigned int);
+        eq::Window::frameStart(frame_id, frame_number);
     }
 };
 
 class eq_channel : public eq::Channel
 {
+private:
+    // The combined projection and modelview matrix for which the visible
+    // area of a wall or cylinder screen was last computed, and that area
+    // (relative screen area, origin top left)
+    float visible_mvp[16];
+    eq::Viewport visible_screen_area;
+
+    // Determine which part of a desktop this channel shows and at which
+    // pixel density, and tell the window, so that only the tiles for that
+    // part are held, at a suitable resolution.
+    eq::Viewport report_visible_area(const eq_init_data& init_data, size_t desktop, const eq_frame_data& frame_data)
+    {
+        float area[4];
+        if (init_data.screen == screen_canvas) {
+            const eq::Viewport& vp = getViewport();
+            float canvas_area[4] = { vp.x, vp.y, vp.w, vp.h };
+            canvas_area_to_screen_area(frame_data.canvas, canvas_area, area);
+        } else {
+            float screen_area[4] = { visible_screen_area.x, visible_screen_area.y,
+                visible_screen_area.w, visible_screen_area.h };
+            screen_area_to_desktop_area(frame_data.placement, screen_area, area);
+        }
+        eq::Viewport visible_area = clamp_desktop_area(area);
+        // The desktop pixels per channel pixel; where the desktop does not
+        // fill the channel, this underestimates the density
+        const eq::PixelViewport& pvp = getPixelViewport();
+        float density = std::min(area[2] * frame_data.vnc_width / std::max(pvp.w, 1),
+                area[3] * frame_data.vnc_height / std::max(pvp.h, 1));
+        static_cast<eq_window*>(getWindow())->texture_window()->set_visible_area(desktop, this, visible_area, density);
+        return visible_area;
+    }
+
+    void update_visible_screen_area(const eq_init_data& init_data)
+    {
+        float p[16], mv[16], mvp[16];
+        glGetFloatv(GL_PROJECTION_MATRIX, p);
+        glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+        mat_mult(p, mv, mvp);
+        if (std::memcmp(mvp, visible_mvp, sizeof(mvp)) != 0) {
+            float area[4];
+            if (screen_area_in_frustum(init_data, mvp, area))
+                visible_screen_area = eq::Viewport(area[0], area[1], area[2], area[3]);
+            else
+                visible_screen_area = eq::Viewport(0.0f, 0.0f, 0.0f, 0.0f);
+            std::memcpy(visible_mvp, mvp, sizeof(mvp));
+        }
+    }
+
+    // Draw the relative desktop area from s0,t0 to s1,t1 (origin top left)
+    // with the mesh, using the bound texture that holds the desktop pixels
+    // tex_r, scaled to the texture size. For the cylinder, the number of
+    // segments is chosen so that each one covers only a few pixels of this
+    // channel.
+    void draw_area(const eq_window* window, const eq_frame_data& frame_data, bool cylinder,
+            const eq::Viewport& visible_area, float s0, float t0, float s1, float t1, const rectangle_t& tex_r)
+    {
+        const float w = frame_data.vnc_width;
+        const float h = frame_data.vnc_height;
+        int segments = 1;
+        if (cylinder && visible_area.w > 0.0f) {
+            float pixels_per_desktop = getPixelViewport().w / visible_area.w;
+            segments = static_cast<int>(std::ceil((s1 - s0) * pixels_per_desktop / 4.0f));
+            segments = std::min(std::max(segments, 1), mesh_segments);
+        }
+        glUniform4f(window->mesh_area_loc, s0, t0, s1, t1);
+        glUniform1f(window->mesh_segments_loc, segments);
+        glUniform4f(window->mesh_tex_map_loc,
+                w / tex_r.w, -tex_r.x / static_cast<float>(tex_r.w),
+                h / tex_r.h, -tex_r.y / static_cast<float>(tex_r.h));
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 2 * (segments + 1));
+    }
+
+    // Draw the statistics summary of the application node and the
+    // statistics of this pipe in the top left corner of the channel
+    void draw_stats(const std::string& text, const pipe_stats_t& stats)
+    {
+        char pipe_text[128];
+        snprintf(pipe_text, sizeof(pipe_text), "pipe %s: sync %.1f ms, upload %.1f ms, %.2f MB",
+                stats.name, stats.sync_time, stats.upload_time, stats.upload_bytes / 1e6f);
+        const eq::util::BitmapFont* font = getWindow()->getSmallFont();
+        const float y = getPixelViewport().h - 16.0f;
+        applyScreenFrustum();
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        glColor3f(1.0f, 1.0f, 1.0f);
+        glRasterPos3f(8.0f, y, 0.99f);
+        font->draw(text);
+        glRasterPos3f(8.0f, y - 16.0f, 0.99f);
+        font->draw(pipe_text);
+    }
+
 public:
     eq_channel(eq::Window *parent) : eq::Channel(parent)
     {
+        std::memset(visible_mvp, 0, sizeof(visible_mvp));
     }
 
 protected:
@@ -536,81 +3924,107 @@ protected:
         eq::Channel::frameDraw(frame_id);
         const eq_node* node = static_cast<eq_node*>(getNode());
         const eq_pipe* pipe = static_cast<eq_pipe*>(getPipe());
-        const eq_window* window = static_cast<eq_window*>(getWindow());
+        const eq_window* window = static_cast<eq_window*>(getWindow())->texture_window();
         const eq_init_data& init_data = node->init_data;
-        const eq_frame_data& frame_data = pipe->frame_data;
+        const bool cylinder = (init_data.screen == screen_cylinder);
+        // Determine the transformations of the mesh
+        float mvp[16], model[16];
+        mat_identity(mvp);
+        mat_identity(model);
+        if (init_data.screen != screen_canvas) {
+            update_visible_screen_area(init_data);
+            float p[16], mv[16];
+            glGetFloatv(GL_PROJECTION_MATRIX, p);
+            glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+            mat_mult(p, mv, mvp);
+            if (init_data.screen == screen_wall) {
+                // Map the screen (origin top left) to the wall
+                const float* bl = init_data.wall + 0;
+                const float* br = init_data.wall + 3;
+                const float* tl = init_data.wall + 6;
+                for (int i = 0; i < 3; i++) {
+                    model[0 + i] = br[i] - bl[i];
+                    model[4 + i] = bl[i] - tl[i];
+                    model[12 + i] = tl[i];
+                }
+            } else {
+                cylinder_matrix(init_data.cylinder, model);
+            }
+        }
         // Setup GL state
-        glDisable(GL_LIGHTING);
         glDisable(GL_DEPTH_TEST);
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, window->tex);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-        if (node->init_data.screen == screen_canvas) {
-            // Determine the quad for this channel's area on the canvas
-            const eq::Viewport &canvas_channel_area = getViewport();
-            float quad_x = ((frame_data.canvas[2] - canvas_channel_area.x) / canvas_channel_area.w - 0.5f) * 2.0f;
-            float quad_y = ((frame_data.canvas[3] - canvas_channel_area.y) / canvas_channel_area.h - 0.5f) * 2.0f;
-            float quad_w = 2.0f * frame_data.canvas[4] / canvas_channel_area.w;
-            float quad_h = 2.0f * frame_data.canvas[5] / canvas_channel_area.h;
-            glMatrixMode(GL_PROJECTION);
-            glLoadIdentity();
-            glMatrixMode(GL_MODELVIEW);
-            glLoadIdentity();
-            glBegin(GL_QUADS);
-            glTexCoord2f(0.0f, 1.0f);
-            glVertex2f(quad_x, quad_y);
-            glTexCoord2f(1.0f, 1.0f);
-            glVertex2f(quad_x + quad_w, quad_y);
-            glTexCoord2f(1.0f, 0.0f);
-            glVertex2f(quad_x + quad_w, quad_y + quad_h);
-            glTexCoord2f(0.0f, 0.0f);
-            glVertex2f(quad_x, quad_y + quad_h);
-            glEnd();
-        } else if (node->init_data.screen == screen_wall) {
-            float bl[3] = { init_data.wall[0], init_data.wall[1], init_data.wall[2] };
-            float br[3] = { init_data.wall[3], init_data.wall[4], init_data.wall[5] };
-            float tl[3] = { init_data.wall[6], init_data.wall[7], init_data.wall[8] };
-            float tr[3] = { br[0] + (tl[0] - bl[0]), br[1] + (tl[1] - bl[1]), br[2] + (tl[2] - bl[2]) };
-            glBegin(GL_QUADS);
-            glTexCoord2f(0.0f, 1.0f);
-            glVertex3fv(bl);
-            glTexCoord2f(1.0f, 1.0f);
-            glVertex3fv(br);
-            glTexCoord2f(1.0f, 0.0f);
-            glVertex3fv(tr);
-            glTexCoord2f(0.0f, 0.0f);
-            glVertex3fv(tl);
-            glEnd();
-        } else { // node->init_data.screen == screen_cylinder 
-            float center[3] = { init_data.cylinder[0], init_data.cylinder[1], init_data.cylinder[2] };
-            float up[3] = { init_data.cylinder[3], init_data.cylinder[4], init_data.cylinder[5] };
-            float radius = init_data.cylinder[6];
-            float phi_center = init_data.cylinder[7];
-            float phi_range = init_data.cylinder[8];
-            float theta_range = init_data.cylinder[9];
-            float py = radius * std::tan(theta_range / 2.0f);
-            float default_up[3] = { 0.0f, 1.0f, 0.0f };
-            float rot_axis[3];
-            float rot_angle;
-            cross(default_up, up, rot_axis);
-            rot_angle = std::acos(dot(default_up, up) / std::sqrt(dot(default_up, default_up) * dot(up, up)));
-            glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-            glRotatef(rad_to_deg(rot_angle), rot_axis[0], rot_axis[1], rot_axis[2]);
-            glTranslatef(center[0], center[1], center[2]);
-            glBegin(GL_TRIANGLE_STRIP);
-            const int N = 1000;
-            for (int x = 0; x <= N; x++) {
-                float xf = x / static_cast<float>(N);
-                float phi = phi_center + (xf - 0.5f) * phi_range;
-                float px = radius * std::cos(phi);
-                float pz = radius * std::sin(phi);
-                glTexCoord2f(xf, 0.0f);
-                glVertex3f(px, py, pz);
-                glTexCoord2f(xf, 1.0f);
-                glVertex3f(px, -py, pz);
-            }
-            glEnd();
+        glUseProgram(window->mesh_prg);
+        glUniformMatrix4fv(window->mesh_mvp_loc, 1, GL_FALSE, mvp);
+        glUniform1i(window->mesh_cylinder_loc, cylinder ? 1 : 0);
+        glUniform4f(window->mesh_cylinder_params_loc,
+                init_data.cylinder[6], init_data.cylinder[7], init_data.cylinder[8],
+                init_data.cylinder[6] * std::tan(init_data.cylinder[9] / 2.0f));
+        glUniform1i(window->mesh_tex_loc, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindBuffer(GL_ARRAY_BUFFER, window->mesh_vbo);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        glEnableVertexAttribArray(0);
+        for (size_t d = 0; d < pipe->frame_data().size(); d++) {
+            const eq_frame_data& frame_data = *(pipe->frame_data()[d]);
+            const eq::Viewport visible_area = report_visible_area(init_data, d, frame_data);
+            if (d >= window->desktops.size())
+                continue;
+            const desktop_textures_t& desktop = window->desktops[d];
+            if (init_data.screen == screen_canvas) {
+                // Map the desktop to this channel's area on the canvas
+                const eq::Viewport &canvas_channel_area = getViewport();
+                float quad_x = ((frame_data.canvas[2] - canvas_channel_area.x) / canvas_channel_area.w - 0.5f) * 2.0f;
+                float quad_y = ((frame_data.canvas[3] - canvas_channel_area.y) / canvas_channel_area.h - 0.5f) * 2.0f;
+                float quad_w = 2.0f * frame_data.canvas[4] / canvas_channel_area.w;
+                float quad_h = 2.0f * frame_data.canvas[5] / canvas_channel_area.h;
+                model[0] = quad_w;
+                model[5] = -quad_h;
+                model[12] = quad_x;
+                model[13] = quad_y + quad_h;
+                glUniform4f(window->mesh_placement_loc, 0.0f, 0.0f, 1.0f, 1.0f);
+            } else {
+                glUniform4f(window->mesh_placement_loc, frame_data.placement[0], frame_data.placement[1],
+                        frame_data.placement[2], frame_data.placement[3]);
+            }
+            glUniformMatrix4fv(window->mesh_model_loc, 1, GL_FALSE, model);
+            // Draw the tiles that intersect the visible area
+            const float w = frame_data.vnc_width;
+            const float h = frame_data.vnc_height;
+            for (size_t i = 0; i < desktop.tiles.size(); i++) {
+                const tile_t& t = desktop.tiles[i];
+                float s0 = t.r.x / w;
+                float t0 = t.r.y / h;
+                float s1 = (t.r.x + t.r.w) / w;
+                float t1 = (t.r.y + t.r.h) / h;
+                if (t.tex == 0
+                        || s1 <= visible_area.x || s0 >= visible_area.x + visible_area.w
+                        || t1 <= visible_area.y || t0 >= visible_area.y + visible_area.h)
+                    continue;
+                // The texture may cover a bit more than tex_r at reduced
+                // resolution
+                rectangle_t tex_area = { t.tex_r.x, t.tex_r.y, t.tex_w << desktop.lod, t.tex_h << desktop.lod };
+                glBindTexture(GL_TEXTURE_2D, t.tex);
+                draw_area(window, frame_data, cylinder, visible_area, s0, t0, s1, t1, tex_area);
+            }
+            // Draw the cursor overlay
+            const cursor_t& cursor = frame_data.cursor;
+            if (desktop.cursor_tex != 0 && cursor.w > 0 && cursor.h > 0 && w > 0.0f && h > 0.0f) {
+                rectangle_t r = { frame_data.cursor_x - cursor.hot_x, frame_data.cursor_y - cursor.hot_y,
+                    cursor.w, cursor.h };
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                glBindTexture(GL_TEXTURE_2D, desktop.cursor_tex);
+                draw_area(window, frame_data, cylinder, visible_area,
+                        r.x / w, r.y / h, (r.x + r.w) / w, (r.y + r.h) / h, r);
+                glDisable(GL_BLEND);
+            }
         }
+        glDisableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glUseProgram(0);
+        const std::vector<eq_frame_data*>& frame_data = pipe->frame_data();
+        if (init_data.stats_hud && !frame_data.empty() && !frame_data[0]->stats_text.empty())
+            draw_stats(frame_data[0]->stats_text, pipe->stats);
     }
 };
 
@@ -627,43 +4041,199 @@ public:
 eq_config* appnode_eq_config = NULL;
 
 
-/* libvncclient callbacks */
+/* Benchmark */
+
+typedef enum {
+    trace_idle,         // a blinking cursor and a clock
+    trace_scrolling,    // scrolling through a text document
+    trace_video         // a 1280x720 video in a window
+} synthetic_trace_t;
+
+static unsigned int synthetic_pixel(synthetic_trace_t trace, int x, int y, int index)
+{
+    if (trace == trace_scrolling) {
+        // Lines of text; the document moves up by 16 pixels per record
+        int doc_y = y + 16 * index;
+        int line = doc_y / 20;
+        int column = x / 10;
+        bool ink = doc_y % 20 < 14 && x % 10 < 7 && (line * 7 + column * 13) % 11 < 6 && (x * 3 + doc_y * 5) % 4 != 0;
+        return ink ? 0x202020u : 0xffffffu;
+    } else if (trace == trace_video) {
+        if (x >= 320 && x < 1600 && y >= 180 && y < 900)
+            return (((x * 5 + index * 3) & 0xff) << 16) | (((y * 3 + index * 7) & 0xff) << 8) | (((x ^ y) + index) & 0xff);
+        return 0x404060u;
+    } else {
+        bool cursor_on = (index / 30) % 2 == 0;
+        if (x >= 100 && x < 102 && y >= 100 && y < 116 && cursor_on)
+            return 0x000000u;
+        if (x >= 1800 && x < 1880 && y >= 1050 && y < 1066)
+            return ((x / 10 + index / 60) % 3 == 0 && y % 4 != 0) ? 0xffffffu : 0x202020u;
+        return 0x3a6ea5u;
+    }
+}
 
-static rfbBool vnc_resize(rfbClient* client)
+static void add_synthetic_rectangle(synthetic_trace_t trace, int index, const rectangle_t& r, trace_record_t& rec)
 {
-    //fprintf(stderr, "RESIZE to %dx%d\n", client->width, client->height);
-    eq_frame_data& frame_data = appnode_eq_config->frame_data;
-    frame_data.vnc_width = client->width;
-    frame_data.vnc_height = client->height;
-    frame_data.vnc_framebuffer.resize(client->width * client->height);
-    frame_data.vnc_dirty_rectangles.clear();
-    rectangle_t r = { 0, 0, client->width, client->height };
-    frame_data.vnc_dirty_rectangles.push_back(r);
-    client->updateRect.x = 0;
-    client->updateRect.y = 0;
-    client->updateRect.w = client->width;
-    client->updateRect.h = client->height;
-    client->frameBuffer = reinterpret_cast<uint8_t*>(&(frame_data.vnc_framebuffer[0]));
-    client->format.bitsPerPixel = 32;
-    client->format.depth = 8;
-    client->format.redMax = 255;
-    client->format.greenMax = 255;
-    client->format.blueMax = 255;
-    client->format.redShift = 16;
-    client->format.greenShift = 8;
-    client->format.blueShift = 0;
-    SetFormatAndEncodings(client);
-    return TRUE;
+    rec.dirty_rectangles.push_back(r);
+    for (int y = r.y; y < r.y + r.h; y++)
+        for (int x = r.x; x < r.x + r.w; x++)
+            rec.pixels.push_back(synthetic_pixel(trace, x, y, index));
 }
 
-static void vnc_update(rfbClient* /* client */, int x, int y, int w, int h)
+// Generate the records of a synthetic trace: ten seconds of a 1920x1080
+// desktop at 60 updates per second. The first record holds the complete
+// desktop. Returns false after the last record.
+static bool synthetic_trace_record(synthetic_trace_t trace, int index, trace_record_t& rec)
 {
-    //fprintf(stderr, "UPDATING %dx%d rectangle at %d,%d\n", w, h, x, y);
-    eq_frame_data& frame_data = appnode_eq_config->frame_data;
-    rectangle_t r = { x, y, w, h };
-    frame_data.vnc_dirty_rectangles.push_back(r);
+    const int width = 1920, height = 1080, records = 600;
+    if (index >= records)
+        return false;
+    rec.time = index * 1000.0f / 60.0f;
+    rec.width = width;
+    rec.height = height;
+    rec.copy_rectangles.clear();
+    rec.dirty_rectangles.clear();
+    rec.pixels.clear();
+    if (index == 0) {
+        rectangle_t r = { 0, 0, width, height };
+        add_synthetic_rectangle(trace, index, r, rec);
+    } else if (trace == trace_scrolling) {
+        copy_rectangle_t c = { 0, 16, 0, 0, width, height - 16 };
+        rec.copy_rectangles.push_back(c);
+        rectangle_t r = { 0, height - 16, width, 16 };
+        add_synthetic_rectangle(trace, index, r, rec);
+    } else if (trace == trace_video) {
+        rectangle_t r = { 320, 180, 1280, 720 };
+        add_synthetic_rectangle(trace, index, r, rec);
+    } else {
+        if (index % 30 == 0) {
+            rectangle_t r = { 100, 100, 2, 16 };
+            add_synthetic_rectangle(trace, index, r, rec);
+        }
+        if (index % 60 == 0) {
+            rectangle_t r = { 1800, 1050, 80, 16 };
+            add_synthetic_rectangle(trace, index, r, rec);
+        }
+    }
+    return true;
 }
 
+// Run the transport code of the application node and of the render nodes
+// on a trace and report the throughput. The trace is either a recorded file
+// or one of the synthetic traces "idle", "scrolling", and "video".
+static int run_benchmark(const char* trace_name, transport_format_t format, bool use_delta)
+{
+    synthetic_trace_t synthetic = trace_idle;
+    FILE* f = NULL;
+    if (std::strcmp(trace_name, "idle") == 0) {
+        synthetic = trace_idle;
+    } else if (std::strcmp(trace_name, "scrolling") == 0) {
+        synthetic = trace_scrolling;
+    } else if (std::strcmp(trace_name, "video") == 0) {
+        synthetic = trace_video;
+    } else {
+        f = fopen(trace_name, "rb");
+        if (!f) {
+            fprintf(stderr, "Cannot open %s: %s\n", trace_name, std::strerror(errno));
+            return 1;
+        }
+        if (!read_trace_header(f)) {
+            fprintf(stderr, "%s is not a valid trace\n", trace_name);
+            fclose(f);
+            return 1;
+        }
+    }
+    int width = 0, height = 0;
+    std::vector<unsigned int> framebuffer;      // application node
+    std::vector<unsigned int> reference;        // application node with use_delta
+    std::vector<unsigned int> received;         // render node
+    memory_ostream os;
+    lunchbox::Clock clock;
+    double write_time = 0.0, read_time = 0.0;
+    long long changed_bytes = 0, transport_bytes = 0;
+    int records = 0;
+    trace_record_t rec;
+    while (f ? read_trace_record(f, rec) : synthetic_trace_record(synthetic, records, rec)) {
+        bool resized = (rec.width != width || rec.height != height);
+        if (resized) {
+            width = rec.width;
+            height = rec.height;
+            framebuffer.assign(width * height, 0);
+            received.assign(width * height, 0);
+            reference.clear();
+        }
+        apply_trace_record(rec, &(framebuffer[0]));
+        std::vector<copy_rectangle_t> copies;
+        std::vector<rectangle_t> rectangles;
+        if (resized) {
+            rectangle_t r = { 0, 0, width, height };
+            rectangles.push_back(r);
+        } else {
+            copies = rec.copy_rectangles;
+            for (size_t i = 0; i < rec.dirty_rectangles.size(); i++)
+                add_dirty_rectangle(rectangles, rec.dirty_rectangles[i]);
+        }
+        // Application node, as in eq_frame_data::getInstanceData()
+        const bool delta = (use_delta && !reference.empty() && format != format_yuv420);
+        const encoding_t encoding = (delta ? encoding_xor : encoding_raw);
+        for (size_t i = 0; delta && i < copies.size(); i++)
+            copy_pixels(&(reference[0]), width, copies[i]);
+        std::vector<encoding_t> encodings(rectangles.size(), encoding);
+        std::vector<transport_format_t> formats(rectangles.size(), format);
+        std::vector<std::vector<uint8_t> > encoded;
+        os.data.clear();
+        clock.reset();
+        encode_rectangles(&(framebuffer[0]), delta ? &(reference[0]) : NULL, width,
+                rectangles, encodings, formats, encoded);
+        for (size_t i = 0; i < rectangles.size(); i++)
+            write_rectangle(os, &(framebuffer[0]), width, rectangles[i], format, encoding, encoded[i]);
+        write_time += clock.getTimed();
+        transport_bytes += os.data.size();
+        if (use_delta) {
+            if (reference.empty()) {
+                reference = framebuffer;
+            } else {
+                for (size_t i = 0; i < rectangles.size(); i++) {
+                    const rectangle_t& r = rectangles[i];
+                    for (int y = r.y; y < r.y + r.h; y++)
+                        std::memcpy(&(reference[y * width + r.x]), &(framebuffer[y * width + r.x]),
+                                r.w * sizeof(unsigned int));
+                }
+            }
+        }
+        // Render node, as in eq_frame_data::applyInstanceData()
+        memory_istream is(os.data);
+        clock.reset();
+        for (size_t i = 0; i < copies.size(); i++)
+            copy_pixels(&(received[0]), width, copies[i]);
+        for (size_t i = 0; i < rectangles.size(); i++)
+            read_rectangle(is, &(received[0]), width, rectangles[i], format, encoding);
+        read_time += clock.getTimed();
+        for (size_t i = 0; i < rectangles.size(); i++)
+            changed_bytes += static_cast<long long>(rectangles[i].w) * rectangles[i].h * sizeof(unsigned int);
+        records++;
+    }
+    if (f)
+        fclose(f);
+    if (records == 0) {
+        fprintf(stderr, "%s is not a valid trace\n", trace_name);
+        return 1;
+    }
+    write_time = std::max(write_time, 1e-3);
+    read_time = std::max(read_time, 1e-3);
+    printf("%s: %d records, %dx%d desktop\n", trace_name, records, width, height);
+    printf("  changed pixel data: %.1f MB, transport data: %.1f MB\n", changed_bytes / 1e6, transport_bytes / 1e6);
+    printf("  serialization:   %8.1f ms, %8.1f MB/s, %8.1f frames/s\n",
+            write_time, changed_bytes / write_time / 1e3, records / write_time * 1e3);
+    printf("  deserialization: %8.1f ms, %8.1f MB/s, %8.1f frames/s\n",
+            read_time, changed_bytes / read_time / 1e3, records / read_time * 1e3);
+    printf("  total:           %8.1f frames/s\n", records / (write_time + read_time) * 1e3);
+    if (format == format_rgb32 && received != framebuffer) {
+        fprintf(stderr, "The render node framebuffer differs from the application node framebuffer\n");
+        return 1;
+    }
+    return 0;
+}
 
 /* main() */
 
@@ -736,29 +4306,173 @@ static bool get_lookat(const char* opt, float head_matrix[16])
     return false;
 }
 
+static bool get_placement(const char* opt, eq::Viewport& placement)
+{
+    float x, y, w, h;
+    if (std::sscanf(opt, "%f,%f,%f,%f", &x, &y, &w, &h) != 4 || w <= 0.0f || h <= 0.0f)
+        return false;
+    placement = eq::Viewport(x, y, w, h);
+    return true;
+}
+
+// A desktop given on the command line: a VNC server, a trace to replay, or
+// (if neither) the server given in the libvncclient arguments
+typedef struct {
+    const char* server;
+    const char* replay_file_name;
+    bool has_placement;
+    eq::Viewport placement;
+} desktop_spec_t;
+
+static void add_desktop_spec(std::vector<desktop_spec_t>& desktops, const char* server, const char* replay_file_name)
+{
+    desktop_spec_t d;
+    d.server = server;
+    d.replay_file_name = replay_file_name;
+    d.has_placement = false;
+    desktops.push_back(d);
+}
+
+// Get the value of an option given as "--name=value" or "--name value"
+static const char* get_option_value(int argc, char* argv[], int& i, const char* name)
+{
+    size_t l = std::strlen(name);
+    if (std::strncmp(argv[i], name, l) != 0)
+        return NULL;
+    if (argv[i][l] == '=')
+        return argv[i] + l + 1;
+    if (argv[i][l] == '\0' && i + 1 < argc)
+        return argv[++i];
+    return NULL;
+}
+
 int main(int argc, char* argv[])
 {
-    /* Initialize Equalizer */
-    eq_node_factory enf;
-    if (!eq::init(argc, argv, &enf)) {
-        fprintf(stderr, "Equalizer initialization failed\n");
-        return 1;
-    }
-    appnode_eq_config = static_cast<eq_config*>(eq::getConfig(argc, argv));
-    // The following code is only executed on the application node because
-    // eq::getConfig() does not return on other nodes.
-    if (!appnode_eq_config) {
-        fprintf(stderr, "Cannot get Equalizer configuration\n");
-        return 1;
-    }
-    // Get command line options
+    /* Get command line options */
     bool view_only = false;
+    bool roi = false;
+    bool on_demand = false;
+    bool local_cursor = false;
+    bool detect_changes = false;
+    bool multicast = false;
+    const char* stats_file_name = NULL;
+    float stats_interval = 0.0f;
+    bool stats_hud = false;
+    const char* record_file_name = NULL;
+    std::vector<desktop_spec_t> desktops;
+    const char* benchmark_trace = NULL;
+    float pointer_interval = 10.0f;
+    int min_quality = -1;
+    float max_fps = 0.0f;
+    int latency = -1;
+    bool has_compressor = false;
+    uint32_t compressor = 0;
+    bool use_delta = false;
+    bool paced_updates = false;
+    bool lod = false;
+    bool detect_video = false;
+    transport_format_t format = format_rgb32;
     screen_t screen = screen_canvas;
     float screen_def[10];
     float head_matrix[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
     for (int i = 1; i < argc; i++) {
+        const char* optval;
         if (std::strcmp(argv[i], "--view-only") == 0) {
             view_only = true;
+        } else if (std::strcmp(argv[i], "--roi") == 0) {
+            roi = true;
+        } else if (std::strcmp(argv[i], "--on-demand") == 0) {
+            on_demand = true;
+        } else if (std::strcmp(argv[i], "--multicast") == 0) {
+            multicast = true;
+        } else if (std::strcmp(argv[i], "--detect-changes") == 0) {
+            detect_changes = true;
+        } else if (std::strcmp(argv[i], "--local-cursor") == 0) {
+            local_cursor = true;
+        } else if (std::strcmp(argv[i], "--paced-updates") == 0) {
+            paced_updates = true;
+        } else if (std::strcmp(argv[i], "--lod") == 0) {
+            lod = true;
+        } else if (std::strcmp(argv[i], "--video-regions") == 0) {
+            detect_video = true;
+        } else if ((optval = get_option_value(argc, argv, i, "--transport-compression"))) {
+            has_compressor = true;
+            if (std::strcmp(optval, "none") == 0) {
+                compressor = EQ_COMPRESSOR_NONE;
+            } else if (std::strcmp(optval, "rle") == 0) {
+                compressor = EQ_COMPRESSOR_RLE_4_BYTE;
+#ifdef EQ_COMPRESSOR_SNAPPY_BYTE
+            } else if (std::strcmp(optval, "snappy") == 0) {
+                compressor = EQ_COMPRESSOR_SNAPPY_BYTE;
+#endif
+            } else if (std::strcmp(optval, "auto") == 0) {
+                has_compressor = false;
+            } else {
+                fprintf(stderr, "Invalid argument to --transport-compression\n");
+                return 1;
+            }
+        } else if ((optval = get_option_value(argc, argv, i, "--transport-format"))) {
+            if (std::strcmp(optval, "rgb32") == 0) {
+                format = format_rgb32;
+            } else if (std::strcmp(optval, "rgb565") == 0) {
+                format = format_rgb565;
+            } else if (std::strcmp(optval, "yuv420") == 0) {
+                format = format_yuv420;
+            } else {
+                fprintf(stderr, "Invalid argument to --transport-format\n");
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--transport-delta") == 0) {
+            use_delta = true;
+        } else if (std::strcmp(argv[i], "--adaptive-quality") == 0) {
+            min_quality = 3;
+        } else if ((optval = get_option_value(argc, argv, i, "--adaptive-quality"))) {
+            if (std::sscanf(optval, "%d", &min_quality) != 1 || min_quality < 0 || min_quality > 9) {
+                fprintf(stderr, "Invalid argument to --adaptive-quality\n");
+                return 1;
+            }
+        } else if ((optval = get_option_value(argc, argv, i, "--pointer-interval"))) {
+            if (std::sscanf(optval, "%f", &pointer_interval) != 1 || pointer_interval < 0.0f) {
+                fprintf(stderr, "Invalid argument to --pointer-interval\n");
+                return 1;
+            }
+        } else if ((optval = get_option_value(argc, argv, i, "--stats-file"))) {
+            stats_file_name = optval;
+        } else if ((optval = get_option_value(argc, argv, i, "--stats-interval"))) {
+            if (std::sscanf(optval, "%f", &stats_interval) != 1 || stats_interval < 0.0f) {
+                fprintf(stderr, "Invalid argument to --stats-interval\n");
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--stats-hud") == 0) {
+            stats_hud = true;
+        } else if ((optval = get_option_value(argc, argv, i, "--record"))) {
+            record_file_name = optval;
+        } else if ((optval = get_option_value(argc, argv, i, "--replay"))) {
+            add_desktop_spec(desktops, NULL, optval);
+        } else if ((optval = get_option_value(argc, argv, i, "--vnc-server"))) {
+            add_desktop_spec(desktops, optval, NULL);
+        } else if ((optval = get_option_value(argc, argv, i, "--placement"))) {
+            if (desktops.empty()) {
+                fprintf(stderr, "--placement must follow --vnc-server or --replay\n");
+                return 1;
+            }
+            if (!get_placement(optval, desktops.back().placement)) {
+                fprintf(stderr, "Invalid argument to --placement\n");
+                return 1;
+            }
+            desktops.back().has_placement = true;
+        } else if ((optval = get_option_value(argc, argv, i, "--benchmark"))) {
+            benchmark_trace = optval;
+        } else if ((optval = get_option_value(argc, argv, i, "--max-fps"))) {
+            if (std::sscanf(optval, "%f", &max_fps) != 1 || max_fps < 0.0f) {
+                fprintf(stderr, "Invalid argument to --max-fps\n");
+                return 1;
+            }
+        } else if ((optval = get_option_value(argc, argv, i, "--latency"))) {
+            if (std::sscanf(optval, "%d", &latency) != 1 || latency < 0) {
+                fprintf(stderr, "Invalid argument to --latency\n");
+                return 1;
+            }
         } else if (std::strcmp(argv[i], "--screen") == 0) {
             if (!get_screen(argv[i + 1], screen, screen_def)) {
                 fprintf(stderr, "Invalid argument to --screen\n");
@@ -783,37 +4497,172 @@ int main(int argc, char* argv[])
             }
         }
     }
-    if (!appnode_eq_config->init(view_only, screen, screen_def, head_matrix)) {
-        fprintf(stderr, "Cannot initialize Equalizer configuration\n");
+    if (benchmark_trace)
+        return run_benchmark(benchmark_trace, format, use_delta);
+    if (desktops.empty())
+        add_desktop_spec(desktops, NULL, NULL);
+    if (record_file_name && desktops.size() > 1) {
+        fprintf(stderr, "--record supports only a single desktop\n");
         return 1;
     }
+    // Desktops without a placement are arranged in a grid covering the
+    // whole screen
+    std::vector<eq::Viewport> placements;
+    int grid_columns = std::ceil(std::sqrt(static_cast<float>(desktops.size())));
+    int grid_rows = (desktops.size() + grid_columns - 1) / grid_columns;
+    for (size_t i = 0; i < desktops.size(); i++) {
+        if (desktops[i].has_placement) {
+            placements.push_back(desktops[i].placement);
+        } else {
+            placements.push_back(eq::Viewport(
+                        static_cast<float>(i % grid_columns) / grid_columns,
+                        static_cast<float>(i / grid_columns) / grid_rows,
+                        1.0f / grid_columns, 1.0f / grid_rows));
+        }
+    }
 
-    /* Initialize the VNC client */
-    vnc_client = rfbGetClient(8, 3, 4); // 32 bpp
-    vnc_client->MallocFrameBuffer = vnc_resize;
-    vnc_client->canHandleNewFBSize = TRUE;
-    vnc_client->GotFrameBufferUpdate = vnc_update;
-    vnc_client->listenPort = LISTEN_PORT_OFFSET;
-#ifdef HAVE_RFBCLIENT_LISTEN6PORT
-    vnc_client->listen6Port = LISTEN_PORT_OFFSET;
-#endif
-    if (!rfbInitClient(vnc_client, &argc, argv)) {
-        fprintf(stderr, "Cannot initialize VNC client\n");
+    /* Initialize Equalizer */
+    eq_node_factory enf;
+    if (!eq::init(argc, argv, &enf)) {
+        fprintf(stderr, "Equalizer initialization failed\n");
         return 1;
     }
+    appnode_eq_config = static_cast<eq_config*>(eq::getConfig(argc, argv));
+    // The following code is only executed on the application node because
+    // eq::getConfig() does not return on other nodes.
+    if (!appnode_eq_config) {
+        fprintf(stderr, "Cannot get Equalizer configuration\n");
+        return 1;
+    }
+    if (multicast) {
+        if (!appnode_eq_config->has_multicast())
+            fprintf(stderr, "No multicast (RSP) connection configured for the application node; "
+                    "frame data will be sent via unicast\n");
+        if (roi)
+            fprintf(stderr, "Frame data in --roi mode is specific to each render node and will be sent via unicast\n");
+    }
+    if (!appnode_eq_config->init_stats(stats_file_name, stats_interval, stats_hud))
+        return 1;
+
+    /* Initialize the VNC clients */
+    // Each connection runs in its own thread and notifies the main loop of
+    // new data. The threads connect while the Equalizer configuration is
+    // initialized, so that the complete desktops are usually available for
+    // the first frame.
+    update_notifier notifier;
+    for (size_t d = 0; d < desktops.size(); d++) {
+        vnc_connection* vnc = new vnc_connection(&notifier);
+        vnc_connections.push_back(vnc);
+        vnc->set_change_detection(detect_changes);
+        vnc->set_pointer_interval(pointer_interval);
+        if (min_quality >= 0)
+            vnc->set_adaptive_quality(min_quality);
+        vnc->set_paced_updates(paced_updates);
+        if (record_file_name && !vnc->set_record_file(record_file_name))
+            return 1;
+        if (desktops[d].replay_file_name) {
+            if (!vnc->init_replay(desktops[d].replay_file_name))
+                return 1;
+        } else {
+            // libvncclient removes the options it handles from the
+            // arguments and uses the last remaining one as the server, so
+            // each connection gets a copy with its server appended.
+            std::vector<char*> vnc_argv(argv, argv + argc);
+            if (desktops[d].server)
+                vnc_argv.push_back(const_cast<char*>(desktops[d].server));
+            vnc->init_client(vnc_argv.size(), &(vnc_argv[0]), local_cursor);
+        }
+        if (!vnc->start()) {
+            fprintf(stderr, "Cannot start VNC connection thread\n");
+            return 1;
+        }
+    }
+
+    if (!appnode_eq_config->init(placements, view_only, screen, screen_def, head_matrix, roi, lod,
+                format, detect_video, has_compressor, compressor, use_delta)) {
+        fprintf(stderr, "Cannot initialize Equalizer configuration\n");
+        return 1;
+    }
+    if (latency >= 0)
+        appnode_eq_config->setLatency(latency);
+    // The first frame hands the complete desktops to the render nodes;
+    // usually the connections already received them
+    for (size_t d = 0; d < vnc_connections.size(); d++) {
+        while (!vnc_connections[d]->has_failed() && !vnc_connections[d]->has_desktop())
+            notifier.wait(10);
+    }
 
     /* Run the viewer */
+    lunchbox::Clock frame_clock;
+    bool first_frame = true;
+    bool idle = false;
+    bool cursor_changed = false;
     while (appnode_eq_config->isRunning()) {
-        int i = WaitForMessage(vnc_client, 10);
-        if (i > 0 && !HandleRFBServerMessage(vnc_client)) {
-            fprintf(stderr, "VNC event handling failed\n");
-            return 1;
+        bool desktops_changed = false;
+        for (size_t d = 0; d < vnc_connections.size(); d++) {
+            vnc_connection* vnc = vnc_connections[d];
+            if (vnc->has_failed()) {
+                fprintf(stderr, "VNC connection failed\n");
+                return 1;
+            }
+            eq_frame_data& frame_data = *(appnode_eq_config->frame_data[d]);
+            vnc->fetch(frame_data.vnc_width, frame_data.vnc_height, frame_data.vnc_framebuffer,
+                    frame_data.vnc_dirty_rectangles, frame_data.vnc_copy_rectangles);
+            bool cursor_shape_changed;
+            if (vnc->fetch_cursor(frame_data.cursor, cursor_shape_changed,
+                        frame_data.cursor_x, frame_data.cursor_y)) {
+                cursor_changed = true;
+                if (cursor_shape_changed)
+                    frame_data.cursor_shape_changed = true;
+            }
+            if (!frame_data.vnc_dirty_rectangles.empty() || !frame_data.vnc_copy_rectangles.empty())
+                desktops_changed = true;
+        }
+        // In on-demand mode, only draw a frame if a desktop changed or an
+        // event requires it
+        bool redraw = !on_demand || first_frame
+            || desktops_changed
+            || cursor_changed
+            || appnode_eq_config->needs_redraw();
+        float wait = 0.0f;
+        if (redraw && max_fps > 0.0f)
+            wait = 1000.0f / max_fps - frame_clock.getTimef();
+        if (redraw && wait <= 0.0f) {
+            frame_clock.reset();
+            for (size_t d = 0; d < vnc_connections.size(); d++) {
+                int vnc_messages;
+                float vnc_decode_time;
+                vnc_connections[d]->fetch_stats(vnc_messages, vnc_decode_time);
+                appnode_eq_config->add_vnc_stats(vnc_messages, vnc_decode_time);
+            }
+            appnode_eq_config->startFrame();
+            appnode_eq_config->finishFrame();
+            for (size_t d = 0; d < vnc_connections.size(); d++)
+                vnc_connections[d]->frame_done();
+            for (size_t d = 0; d < appnode_eq_config->frame_data.size(); d++) {
+                eq_frame_data& frame_data = *(appnode_eq_config->frame_data[d]);
+                frame_data.vnc_dirty_rectangles.clear();
+                frame_data.vnc_copy_rectangles.clear();
+                frame_data.cursor_shape_changed = false;
+            }
+            cursor_changed = false;
+            first_frame = false;
+            idle = false;
+        } else {
+            if (!redraw && !idle) {
+                // Make sure the last frame is complete on all nodes
+                appnode_eq_config->finishAllFrames();
+                idle = true;
+            }
+            appnode_eq_config->handleEvents();
+            notifier.wait(redraw ? std::max(static_cast<uint32_t>(wait), 1u) : 10u);
         }
-        appnode_eq_config->startFrame();
-        appnode_eq_config->finishFrame();
-        eq_frame_data& frame_data = appnode_eq_config->frame_data;
-        frame_data.vnc_dirty_rectangles.clear();
     }
+    for (size_t d = 0; d < vnc_connections.size(); d++) {
+        vnc_connections[d]->stop();
+        delete vnc_connections[d];
+    }
+    vnc_connections.clear();
 
     return 0;
 }